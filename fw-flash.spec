@@ -7,8 +7,16 @@ Group:          Applications/System
 Url:            http://www.digiteqautomotive.com
 Source0:        fw-flash.tar.gz
 
+# Profile-guided + LTO build trained on the emulator benchmark (--with pgo)
+%bcond_with pgo
+
 BuildRequires:  gcc-c++
 BuildRequires:  make
+# The USDT probes (make fails without <sys/sdt.h> unless NO_SDT=1)
+BuildRequires:  systemtap-sdt-devel
+%if %{with pgo}
+BuildRequires:  gzip
+%endif
 
 
 %description
@@ -19,7 +27,11 @@ fw-flash is a tool for flashing Digiteq Automotive FG4 cards firmware.
 
 %build
 export CFLAGS="${RPM_OPT_FLAGS}"
+%if %{with pgo}
+make %{?_smp_mflags} pgo
+%else
 make %{?_smp_mflags}
+%endif
 
 %install
 make install DESTDIR=%{buildroot} PREFIX=/usr
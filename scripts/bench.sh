@@ -0,0 +1,200 @@
+#!/bin/sh
+
+# End-to-end fw-flash benchmark on the MTD emulator (see make-emu.sh).
+#
+# Measures the card enumeration (libmtd open + part_list()) with 2 to 256 MTD
+# devices, the FW image validation (read_fw()) of T100 and T200 sized images
+# with a cold and a warm page cache, and complete flash runs of both images.
+# Every measurement is repeated RUNS times and the results are written as JSON
+# with min/percentiles/max/mean in nanoseconds to OUT (stdout by default).
+#
+# Usage: bench.sh FW_FLASH [OUT]
+#
+# Environment:
+#   RUNS      number of repetitions (default 20)
+#   EMU_CONF  emulator timing model to use for the flash runs (default none,
+#             i.e. only the software overhead is measured)
+#   TMPDIR    where to create the emulator trees and images
+
+set -e
+
+if [ $# -lt 1 ]; then
+	echo "Usage: $0 FW_FLASH [OUT]" >&2
+	exit 1
+fi
+
+FW_FLASH=$(realpath "$1")
+OUT=${2:--}
+RUNS=${RUNS:-20}
+SCRIPTS=$(dirname "$(realpath "$0")")
+WORK=$(mktemp -d "${TMPDIR:-/tmp}/fw-flash-bench.XXXXXX")
+trap 'rm -rf "$WORK"' EXIT
+
+T100_SIZE=4194304
+T200_SIZE=9764864
+
+# le32 VALUE - print VALUE as 4 little endian bytes
+le32() {
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $(($1 & 255)) \
+	  $(($1 >> 8 & 255)) $(($1 >> 16 & 255)) $(($1 >> 24 & 255)))"
+}
+
+# mkfw CARD_TYPE SIZE OUT - create a random FW image with a valid header. The
+# header CRC is the CRC32 of the header (with zero CRC) and the data, which is
+# exactly what gzip stores in its trailer.
+mkfw() {
+	{
+		le32 $((0x3462676D))
+		le32 $((1 << 24 | $1 << 16 | 1))
+		le32 $2
+		le32 0
+		head -c $2 /dev/urandom
+	} > "$3"
+	gzip -1 -c "$3" | tail -c 8 | head -c 4 \
+	  | dd of="$3" bs=1 seek=12 conv=notrunc status=none
+}
+
+# drop_cache FILE - evict FILE from the page cache
+drop_cache() {
+	dd if="$1" iflag=nocache count=0 status=none
+}
+
+# phase NAME - extract the phase NAME duration from --stats=json lines
+phase() {
+	if [ "$1" = total ]; then
+		sed -n 's/.*"total_ns":\([0-9]*\).*/\1/p'
+	else
+		sed -n "s/.*\"$1\":{\"ns\":\([0-9]*\).*/\1/p"
+	fi
+}
+
+# summary - print the JSON summary of the numbers (one per line) on stdin
+summary() {
+	sort -n | awk '
+		{ v[NR] = $1; sum += $1 }
+		function pct(p,  i) {
+			i = int(NR * p / 100 + 0.999999)
+			return v[i < 1 ? 1 : i]
+		}
+		END {
+			if (!NR) {
+				printf "null"
+				exit
+			}
+			printf "{\"runs\":%d,\"min\":%d,\"p50\":%d,\"p90\":%d," \
+			  "\"p99\":%d,\"max\":%d,\"mean\":%.0f}", NR, v[1], pct(50),
+			  pct(90), pct(99), v[NR], sum / NR
+		}'
+}
+
+# run FILE CMD... - run CMD RUNS times, appending the stats lines to FILE
+run() {
+	file=$1
+	shift
+	: > "$file"
+	i=0
+	while [ $i -lt $RUNS ]; do
+		"$@" 2>> "$file" > /dev/null
+		i=$((i + 1))
+	done
+}
+
+bench_enum() {
+	tree=$WORK/enum
+	cards=0
+	first=1
+
+	printf '"enumerate":['
+	for devices in 2 4 8 16 32 64 128 256; do
+		echo "enumerate: $devices devices" >&2
+		types=
+		while [ $((cards * 2)) -lt $devices ]; do
+			types="$types T100"
+			cards=$((cards + 1))
+		done
+		EMU_SPARSE=1 "$SCRIPTS/make-emu.sh" "$tree" $types
+
+		run "$WORK/out" "$FW_FLASH" -E "$tree" -l --stats=json
+		[ $first ] || printf ','
+		printf '{"devices":%d,"open":%s,"list":%s}' $devices \
+		  "$(phase open < "$WORK/out" | summary)" \
+		  "$(phase list < "$WORK/out" | summary)"
+		first=
+	done
+	printf ']'
+}
+
+# read_fw_cold IMAGE - read_fw() with IMAGE evicted from the page cache
+read_fw_cold() {
+	drop_cache "$1"
+	"$FW_FLASH" -i "$1" --stats=json
+}
+
+bench_read() {
+	first=1
+
+	printf '"read_fw":['
+	for type in T100 T200; do
+		for cache in cold warm; do
+			echo "read_fw: $type $cache" >&2
+			if [ $cache = cold ]; then
+				run "$WORK/out" read_fw_cold "$WORK/$type.bin"
+			else
+				"$FW_FLASH" -i "$WORK/$type.bin" > /dev/null
+				run "$WORK/out" "$FW_FLASH" -i "$WORK/$type.bin" \
+				  --stats=json
+			fi
+			[ $first ] || printf ','
+			printf '{"image":"%s","cache":"%s","read":%s,"crc":%s}' \
+			  $type $cache \
+			  "$(phase read < "$WORK/out" | summary)" \
+			  "$(phase crc < "$WORK/out" | summary)"
+			first=
+		done
+	done
+	printf ']'
+}
+
+bench_flash() {
+	tree=$WORK/flash
+	first=1
+
+	"$SCRIPTS/make-emu.sh" "$tree" T100 T200
+	[ -z "$EMU_CONF" ] || cp "$EMU_CONF" "$tree/emu.conf"
+
+	printf '"flash":['
+	for type in T100 T200; do
+		echo "flash: $type" >&2
+		[ $type = T100 ] && sn=001-000-000-001 || sn=001-000-000-003
+		run "$WORK/out" "$FW_FLASH" -E "$tree" -s $sn "$WORK/$type.bin" \
+		  --stats=json
+		[ $first ] || printf ','
+		printf '{"image":"%s","erase":%s,"write":%s,"total":%s}' $type \
+		  "$(phase erase < "$WORK/out" | summary)" \
+		  "$(phase write < "$WORK/out" | summary)" \
+		  "$(phase total < "$WORK/out" | summary)"
+		first=
+	done
+	printf ']'
+}
+
+mkfw 1 $T100_SIZE "$WORK/T100.bin"
+mkfw 2 $T200_SIZE "$WORK/T200.bin"
+
+{
+	printf '{"version":"%s","date":"%s","host":"%s","runs":%d,' \
+	  "$("$FW_FLASH" -v)" "$(date -u +%Y-%m-%dT%H:%M:%SZ)" \
+	  "$(uname -srm)" $RUNS
+	bench_enum
+	printf ','
+	bench_read
+	printf ','
+	bench_flash
+	printf '}\n'
+} > "$WORK/result.json"
+
+if [ "$OUT" = - ]; then
+	cat "$WORK/result.json"
+else
+	cp "$WORK/result.json" "$OUT"
+fi
@@ -0,0 +1,86 @@
+#!/bin/sh
+
+# Creates (or extends) an MTD emulator tree for "fw-flash -E DIR" with one
+# emulated FG4 card per TYPE argument (T100 or T200).
+#
+# Usage: make-emu.sh DIR TYPE...
+#
+# With EMU_SPARSE set, the device files are created sparse (reading zeros
+# instead of erased flash), which is enough for enumeration and much cheaper
+# for trees with many devices.
+
+set -e
+
+if [ $# -lt 2 ]; then
+	echo "Usage: $0 DIR TYPE..." >&2
+	exit 1
+fi
+
+DIR=$1
+shift
+
+EB_SIZE=65536
+DATA_SIZE=65536
+
+mkdir -p "$DIR/sys/class/mtd" "$DIR/dev"
+
+if [ ! -f "$DIR/emu.conf" ]; then
+	cat > "$DIR/emu.conf" <<CONF
+# MTD emulator timing model, zero means no delay
+erase_us 0
+write_us 0
+write_bps 0
+read_us 0
+read_bps 0
+CONF
+fi
+
+# mtd_dev NUM NAME SIZE
+mtd_dev() {
+	sys="$DIR/sys/class/mtd/mtd$1"
+	mkdir -p "$sys"
+	echo "90:$(($1 * 2))" > "$sys/dev"
+	echo "$2" > "$sys/name"
+	echo nor > "$sys/type"
+	echo $EB_SIZE > "$sys/erasesize"
+	echo $3 > "$sys/size"
+	echo 1 > "$sys/writesize"
+	echo 1 > "$sys/subpagesize"
+	echo 0 > "$sys/oobsize"
+	echo 0 > "$sys/oobavail"
+	echo 0 > "$sys/numeraseregions"
+	echo 0xc00 > "$sys/flags"
+	if [ -n "$EMU_SPARSE" ]; then
+		truncate -s $3 "$DIR/dev/mtd$1"
+	else
+		tr '\000' '\377' < /dev/zero | head -c $3 > "$DIR/dev/mtd$1"
+	fi
+}
+
+# sn NUM - write the card SN (001-000-HHH-LLL, little endian) to mtdNUM
+sn() {
+	printf "$(printf '\\%03o\\%03o\\%03o\\%03o' $(($1 & 255)) $(($1 >> 8 & 255)) 0 1)" \
+	  | dd of="$DIR/dev/mtd$1" conv=notrunc status=none
+}
+
+num=$(ls "$DIR/sys/class/mtd" | wc -l)
+
+for type in "$@"; do
+	case $type in
+		T100)
+			size=4194304
+			;;
+		T200)
+			size=9764864
+			;;
+		*)
+			echo "$type: unknown card type" >&2
+			exit 1
+			;;
+	esac
+
+	mtd_dev $num mgb4-fw $size
+	mtd_dev $((num + 1)) mgb4-data $DATA_SIZE
+	sn $((num + 1))
+	num=$((num + 2))
+done
@@ -1,10 +1,11 @@
 #!/bin/sh
 
-# This script must be run from the repo top directory!
+# This script must be run from the repo top directory! Any arguments are
+# passed to rpmbuild, e.g. "--with pgo" for the profile-guided build.
 
 mkdir -p ~/rpmbuild/{BUILD,BUILDROOT,RPMS,SOURCES,SPECS,SRPMS}
 git archive --prefix fw-flash/ -o fw-flash.tar.gz HEAD
 mv fw-flash.tar.gz ~/rpmbuild/SOURCES
-rpmbuild -ba fw-flash.spec
+rpmbuild -ba "$@" fw-flash.spec
 cp ~/rpmbuild/RPMS/`uname -m`/fw-flash* .
 rm -rf ~/rpmbuild
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+#define CACHE_MAGIC  "fw-flash inventory 2"
+#define BOOT_ID_FILE "/proc/sys/kernel/random/boot_id"
+
+static int boot_id(char *buf, size_t size)
+{
+	FILE *fp;
+
+	if (!(fp = fopen(BOOT_ID_FILE, "r")))
+		return -1;
+	if (!fgets(buf, size, fp)) {
+		fclose(fp);
+		return -1;
+	}
+	fclose(fp);
+
+	buf[strcspn(buf, "\n")] = '\0';
+
+	return 0;
+}
+
+/*
+ * The signature covers everything that changes when a card is added or removed
+ * or when the system is rebooted: the boot id and the identity stamps of all
+ * the MTD devices. Building it requires no flash reads.
+ */
+static int signature(libmtd_t desc, struct cache *cache)
+{
+	struct mtd_info info;
+	char id[64];
+	int i, major, minor;
+	unsigned long long ino;
+	FILE *fp;
+
+	cache->sig = NULL;
+	cache->len = 0;
+
+	if (boot_id(id, sizeof(id)) < 0)
+		return -1;
+	if (mtd_get_info(desc, &info) < 0 || !info.sysfs_supported)
+		return -1;
+	if (!(fp = open_memstream(&cache->sig, &cache->len)))
+		return -1;
+
+	fprintf(fp, "%s\nboot %s\n", CACHE_MAGIC, id);
+	for (i = info.lowest_mtd_num; i <= info.highest_mtd_num; i++) {
+		if (mtd_get_dev_stamp(desc, i, &major, &minor, &ino) < 0) {
+			if (errno == ENOENT)
+				continue;
+			goto error;
+		}
+		fprintf(fp, "dev %d %d:%d %llu\n", i, major, minor, ino);
+	}
+
+	if (fclose(fp)) {
+		cache_free(cache);
+		return -1;
+	}
+
+	return 0;
+
+error:
+	fclose(fp);
+	cache_free(cache);
+
+	return -1;
+}
+
+int cache_load(libmtd_t desc, struct cache *cache, struct registry *reg)
+{
+	char *buf, line[128];
+	struct card card;
+	int end = 0;
+	FILE *fp;
+
+	reg->cnt = 0;
+
+	if (signature(desc, cache) < 0)
+		return -1;
+
+	if (!(fp = fopen(CACHE_FILE, "r")))
+		return -1;
+	if (!(buf = malloc(cache->len)))
+		goto error_fp;
+	if (fread(buf, 1, cache->len, fp) != cache->len
+	  || memcmp(buf, cache->sig, cache->len))
+		goto error_buf;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (!strcmp(line, "end\n")) {
+			end = 1;
+			break;
+		}
+		if (sscanf(line, "card %" SCNu32 " %d %d %d %lld %d %d", &card.sn,
+		  &card.type, &card.fw_num, &card.data_num, &card.fw_size,
+		  &card.eb_size, &card.eb_cnt) != 7 || card.type < 1
+		  || card.type > CARD_TYPES)
+			goto error_reg;
+		if (registry_add(reg, &card) < 0)
+			goto error_reg;
+	}
+	if (!end)
+		goto error_reg;
+
+	free(buf);
+	fclose(fp);
+
+	return 0;
+
+error_reg:
+	reg->cnt = 0;
+error_buf:
+	free(buf);
+error_fp:
+	fclose(fp);
+
+	return -1;
+}
+
+int cache_store(struct cache *cache, const struct registry *reg)
+{
+	char tmp[] = CACHE_FILE ".XXXXXX";
+	const struct card *card;
+	FILE *fp;
+	int fd, i;
+
+	if (!cache->sig)
+		return -1;
+
+	if (mkdir(CACHE_DIR, 0755) < 0 && errno != EEXIST)
+		return -1;
+	if ((fd = mkstemp(tmp)) < 0)
+		return -1;
+	if (fchmod(fd, 0644) < 0 || !(fp = fdopen(fd, "w"))) {
+		close(fd);
+		goto error;
+	}
+
+	fwrite(cache->sig, 1, cache->len, fp);
+	for (i = 0; i < reg->cnt; i++) {
+		card = &reg->cards[i];
+		fprintf(fp, "card %" PRIu32 " %d %d %d %lld %d %d\n", card->sn,
+		  card->type, card->fw_num, card->data_num, card->fw_size,
+		  card->eb_size, card->eb_cnt);
+	}
+	fprintf(fp, "end\n");
+
+	if (fclose(fp))
+		goto error;
+	if (rename(tmp, CACHE_FILE) < 0)
+		goto error;
+
+	return 0;
+
+error:
+	unlink(tmp);
+
+	return -1;
+}
+
+int cache_update(libmtd_t desc, const struct registry *reg)
+{
+	struct cache cache;
+	int ret;
+
+	if (signature(desc, &cache) < 0)
+		return -1;
+	ret = cache_store(&cache, reg);
+	cache_free(&cache);
+
+	return ret;
+}
+
+void cache_free(struct cache *cache)
+{
+	free(cache->sig);
+	cache->sig = NULL;
+	cache->len = 0;
+}
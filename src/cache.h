@@ -0,0 +1,22 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+#include "libmtd.h"
+#include "card.h"
+
+#define CACHE_DIR  "/run/fw-flash"
+#define CACHE_FILE CACHE_DIR "/inventory"
+
+struct cache {
+	char *sig;
+	size_t len;
+};
+
+extern int cache_load(libmtd_t desc, struct cache *cache,
+  struct registry *reg);
+extern int cache_store(struct cache *cache, const struct registry *reg);
+extern int cache_update(libmtd_t desc, const struct registry *reg);
+extern void cache_free(struct cache *cache);
+
+#endif /* CACHE_H */
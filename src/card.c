@@ -0,0 +1,404 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "card.h"
+
+
+#define DATA_PART_NAME "mgb4-data"
+#define FW_PART_NAME   "mgb4-fw"
+
+#define PROBE_THREADS_MAX 8
+
+#define min(a,b) ((a)<(b)?(a):(b))
+
+struct probe {
+	struct mtd_dev_info dev_info;
+	struct card card;
+	int err;
+};
+
+struct probe_queue {
+	libmtd_t desc;
+	struct probe *probes;
+	int cnt;
+	int next;
+};
+
+static int card_cmp(const void *a, const void *b)
+{
+	const struct card *c1 = a, *c2 = b;
+
+	if (c1->sn != c2->sn)
+		return c1->sn < c2->sn ? -1 : 1;
+
+	return c1->fw_num - c2->fw_num;
+}
+
+static int type_cmp(const void *a, const void *b)
+{
+	const struct card *c1 = *(struct card *const *)a;
+	const struct card *c2 = *(struct card *const *)b;
+
+	if (c1->type != c2->type)
+		return c1->type - c2->type;
+
+	return card_cmp(c1, c2);
+}
+
+/* Index of the first card not ordered before SN sn and FW partition fw_num */
+static int lower_bound(const struct registry *reg, uint32_t sn, int fw_num)
+{
+	int lo = 0, hi = reg->cnt, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (reg->cards[mid].sn < sn || (reg->cards[mid].sn == sn
+		  && reg->cards[mid].fw_num < fw_num))
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	return lo;
+}
+
+/* Rebuilds the type index, required after every change of the cards array */
+static void registry_index(struct registry *reg)
+{
+	int i, type;
+
+	for (i = 0; i < reg->cnt; i++)
+		reg->by_type[i] = &reg->cards[i];
+	qsort(reg->by_type, reg->cnt, sizeof(*reg->by_type), type_cmp);
+
+	for (type = 0, i = 0; type <= CARD_TYPES + 1; type++) {
+		while (i < reg->cnt && reg->by_type[i]->type < type)
+			i++;
+		reg->type_start[type] = i;
+	}
+}
+
+static int registry_reserve(struct registry *reg, int cnt)
+{
+	struct card *cards, **by_type;
+	int size = reg->size ? reg->size : 8;
+
+	while (size < cnt)
+		size *= 2;
+	if (size == reg->size)
+		return 0;
+
+	if (!(cards = realloc(reg->cards, size * sizeof(*cards))))
+		return -1;
+	reg->cards = cards;
+	if (!(by_type = realloc(reg->by_type, size * sizeof(*by_type))))
+		return -1;
+	reg->by_type = by_type;
+	reg->size = size;
+
+	return 0;
+}
+
+void registry_free(struct registry *reg)
+{
+	free(reg->cards);
+	free(reg->by_type);
+	memset(reg, 0, sizeof(*reg));
+}
+
+int registry_add(struct registry *reg, const struct card *card)
+{
+	int pos;
+
+	if (registry_reserve(reg, reg->cnt + 1) < 0)
+		return -1;
+
+	pos = lower_bound(reg, card->sn, card->fw_num);
+	memmove(&reg->cards[pos + 1], &reg->cards[pos],
+	  (reg->cnt - pos) * sizeof(*reg->cards));
+	reg->cards[pos] = *card;
+	reg->cnt++;
+	registry_index(reg);
+
+	return 0;
+}
+
+struct card *registry_find(const struct registry *reg, uint32_t sn)
+{
+	int pos = lower_bound(reg, sn, -1);
+
+	return (pos < reg->cnt && reg->cards[pos].sn == sn)
+	  ? &reg->cards[pos] : NULL;
+}
+
+int registry_type(const struct registry *reg, int type,
+  struct card *const **cards)
+{
+	if (type < 1 || type > CARD_TYPES || !reg->cnt)
+		return 0;
+
+	*cards = reg->by_type + reg->type_start[type];
+
+	return reg->type_start[type + 1] - reg->type_start[type];
+}
+
+void sn2str(uint32_t sn, char *buf, size_t size)
+{
+	snprintf(buf, size, "%03d-%03d-%03d-%03d", sn >> 24, (sn >> 16) & 0xFF,
+	  (sn >> 8) & 0xFF, sn & 0xFF);
+}
+
+int str2sn(const char *str, uint32_t *sn)
+{
+	unsigned b0, b1, b2, b3;
+
+	if (sscanf(str, "%03u-%03u-%03u-%03u", &b3, &b2, &b1, &b0) < 4) {
+		fprintf(stderr, "%s: invalid serial number\n", str);
+		return -1;
+	}
+
+	*sn = (b3 << 24) | (b2 << 16) | (b1 << 8) | b0;
+
+	return 0;
+}
+
+struct card *card_find(const struct registry *reg, uint32_t sn)
+{
+	struct card *card;
+
+	if (sn) {
+		if ((card = registry_find(reg, sn)))
+			return card;
+		fprintf(stderr, "0x%x: card not found\n", sn);
+	} else if (reg->cnt == 1)
+		return reg->cards;
+	else if (reg->cnt > 1)
+		fprintf(stderr, "Card not specified (multiple cards present)\n");
+	else
+		fprintf(stderr, "No card found\n");
+
+	return NULL;
+}
+
+void list_print(FILE *fp, const struct registry *reg)
+{
+	struct card *const *cards;
+	char sn[16];
+	int type, i, cnt;
+
+	for (type = 1; type <= CARD_TYPES; type++) {
+		cnt = registry_type(reg, type, &cards);
+		for (i = 0; i < cnt; i++) {
+			sn2str(cards[i]->sn, sn, sizeof(sn));
+			fprintf(fp, "%s (%s)\n", sn, type == 2 ? "T200" : "T100");
+		}
+	}
+}
+
+int card_type(long long size)
+{
+	if (size == 0x400000)
+		return 1;
+	if (size == 0x950000)
+		return 2;
+
+	fprintf(stderr, "Unknown FW partition size (%lld)\n", size);
+
+	return -1;
+}
+
+static void probe_sn(libmtd_t desc, struct probe *p)
+{
+	char mtddev[PATH_MAX];
+	int fd;
+
+	if (mtd_dev_node(desc, p->dev_info.mtd_num, mtddev, sizeof(mtddev)) < 0
+	  || (fd = open(mtddev, O_RDONLY)) < 0) {
+		p->err = errno;
+		return;
+	}
+	if (mtd_read(&p->dev_info, fd, 0, 0, &p->card.sn, sizeof(p->card.sn)) < 0)
+		p->err = errno ? errno : EIO;
+	close(fd);
+}
+
+static void *probe_worker(void *arg)
+{
+	struct probe_queue *q = arg;
+	int i;
+
+	while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->cnt)
+		probe_sn(q->desc, &q->probes[i]);
+
+	return NULL;
+}
+
+/*
+ * The SN reads are independent SPI round-trips, so run them concurrently on
+ * up to PROBE_THREADS_MAX threads (including the calling one). Results are
+ * stored by index, so the outcome does not depend on the completion order.
+ */
+static void probe_all(libmtd_t desc, struct probe *probes, int cnt)
+{
+	struct probe_queue q = {desc, probes, cnt, 0};
+	pthread_t threads[PROBE_THREADS_MAX - 1];
+	int i, nthreads = min(cnt, PROBE_THREADS_MAX) - 1;
+
+	for (i = 0; i < nthreads; i++)
+		if (pthread_create(&threads[i], NULL, probe_worker, &q))
+			break;
+	nthreads = i;
+
+	probe_worker(&q);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(threads[i], NULL);
+}
+
+/* Fills the card of the data partition data from its FW partition fw */
+static int card_init(struct card *card, const struct mtd_dev_info *fw,
+  const struct mtd_dev_info *data)
+{
+	if ((card->type = card_type(fw->size)) < 0)
+		return -1;
+
+	card->sn = 0;
+	card->fw_num = fw->mtd_num;
+	card->data_num = data->mtd_num;
+	card->fw_size = fw->size;
+	card->eb_size = fw->eb_size;
+	card->eb_cnt = fw->eb_cnt;
+
+	return 0;
+}
+
+int part_list(libmtd_t desc, struct registry *reg)
+{
+	struct mtd_info info;
+	struct mtd_dev_info dev_info, fw_info;
+	int i, cnt = 0;
+	struct probe *probes;
+
+	reg->cnt = 0;
+	memset(&fw_info, 0, sizeof(fw_info));
+	fw_info.mtd_num = -1;
+
+	if (mtd_get_info(desc, &info) < 0) {
+		fprintf(stderr, "Error reading MTD info\n");
+		return -1;
+	}
+	if (!(probes = malloc(sizeof(struct probe) * (info.mtd_dev_cnt + 1)))) {
+		fprintf(stderr, "Error allocating MTD probe memory\n");
+		return -1;
+	}
+
+	for (i = info.lowest_mtd_num; i <= info.highest_mtd_num; i++) {
+		if (mtd_get_dev_info1(desc, i, &dev_info) < 0) {
+			fprintf(stderr, "Error getting MTD device #%d info\n", i);
+			goto error;
+		}
+
+		if (!strncmp(dev_info.name, FW_PART_NAME, strlen(FW_PART_NAME))) {
+			memcpy(&fw_info, &dev_info, sizeof(dev_info));
+			continue;
+		}
+		if (strncmp(dev_info.name, DATA_PART_NAME, strlen(DATA_PART_NAME)))
+			continue;
+		if (fw_info.mtd_num != i - 1) {
+			fprintf(stderr, "Partition order mismatch\n");
+			goto error;
+		}
+		if (cnt > info.mtd_dev_cnt) {
+			fprintf(stderr, "MTD devices changed while listing\n");
+			goto error;
+		}
+
+		memcpy(&probes[cnt].dev_info, &dev_info, sizeof(dev_info));
+		if (card_init(&probes[cnt].card, &fw_info, &dev_info) < 0)
+			goto error;
+		probes[cnt].err = 0;
+		cnt++;
+	}
+
+	probe_all(desc, probes, cnt);
+
+	if (registry_reserve(reg, cnt) < 0) {
+		fprintf(stderr, "Error allocating card registry memory\n");
+		goto error;
+	}
+	for (i = 0; i < cnt; i++) {
+		if (probes[i].err) {
+			fprintf(stderr, "Error reading MTD device #%d: %s\n",
+			  probes[i].dev_info.mtd_num, strerror(probes[i].err));
+			goto error;
+		}
+		reg->cards[i] = probes[i].card;
+	}
+	reg->cnt = cnt;
+	qsort(reg->cards, reg->cnt, sizeof(*reg->cards), card_cmp);
+	registry_index(reg);
+
+	free(probes);
+
+	return 0;
+
+error:
+	free(probes);
+	reg->cnt = 0;
+	return -1;
+}
+
+int card_add(libmtd_t desc, struct registry *reg, int num)
+{
+	struct mtd_dev_info fw_info;
+	struct probe p;
+
+	if (mtd_get_dev_info1(desc, num, &p.dev_info) < 0)
+		return -1;
+	if (strncmp(p.dev_info.name, DATA_PART_NAME, strlen(DATA_PART_NAME)))
+		return 0;
+	if (mtd_get_dev_info1(desc, num - 1, &fw_info) < 0
+	  || strncmp(fw_info.name, FW_PART_NAME, strlen(FW_PART_NAME))) {
+		fprintf(stderr, "Partition order mismatch\n");
+		return -1;
+	}
+	if (card_init(&p.card, &fw_info, &p.dev_info) < 0)
+		return -1;
+
+	p.err = 0;
+	probe_sn(desc, &p);
+	if (p.err) {
+		fprintf(stderr, "Error reading MTD device #%d: %s\n", num,
+		  strerror(p.err));
+		return -1;
+	}
+
+	card_remove(reg, num);
+	if (registry_add(reg, &p.card) < 0)
+		return -1;
+
+	return 1;
+}
+
+int card_remove(struct registry *reg, int num)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < reg->cnt; i++) {
+		if (reg->cards[i].fw_num == num || reg->cards[i].data_num == num)
+			cnt++;
+		else if (cnt)
+			reg->cards[i - cnt] = reg->cards[i];
+	}
+	if (cnt) {
+		reg->cnt -= cnt;
+		registry_index(reg);
+	}
+
+	return cnt;
+}
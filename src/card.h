@@ -0,0 +1,65 @@
+#ifndef CARD_H
+#define CARD_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "libmtd.h"
+
+/* Number of card types (1 = T100, 2 = T200) */
+#define CARD_TYPES 2
+
+struct card {
+	uint32_t sn;
+	int type;
+	int fw_num;		/* FW partition MTD device number */
+	int data_num;		/* data partition MTD device number */
+	long long fw_size;	/* FW partition geometry */
+	int eb_size;
+	int eb_cnt;
+};
+
+/*
+ * Card registry: the cards in a contiguous array sorted by SN (and FW
+ * partition number) for O(log n) lookup by SN and stable listing, plus an
+ * index of the cards grouped by type. The card pointers are valid until the
+ * registry is modified.
+ */
+struct registry {
+	struct card *cards;
+	int cnt;
+	int size;
+	struct card **by_type;
+	int type_start[CARD_TYPES + 2];
+};
+
+#define REGISTRY_INIT {NULL, 0, 0, NULL, {0}}
+
+extern int part_list(libmtd_t desc, struct registry *reg);
+extern void registry_free(struct registry *reg);
+/* Inserts a copy of card keeping the order, returns 0 or -1 on error */
+extern int registry_add(struct registry *reg, const struct card *card);
+/* The card with serial number sn or NULL, without any messages */
+extern struct card *registry_find(const struct registry *reg, uint32_t sn);
+/* The cards of type sorted by SN, returns their count */
+extern int registry_type(const struct registry *reg, int type,
+  struct card *const **cards);
+extern void sn2str(uint32_t sn, char *buf, size_t size);
+extern int str2sn(const char *str, uint32_t *sn);
+extern void list_print(FILE *fp, const struct registry *reg);
+/* The card with serial number sn, or the only card present if sn is 0 */
+extern struct card *card_find(const struct registry *reg, uint32_t sn);
+/* Card type (1 = T100, 2 = T200, -1 = unknown) by the FW partition size */
+extern int card_type(long long size);
+
+/*
+ * Incremental updates of a card registry for MTD device hotplug. card_add()
+ * returns 1 if MTD device num is a card data partition and the card was added,
+ * 0 if it is not a card data partition and -1 on error. card_remove() removes
+ * the card owning MTD device num (either of its partitions) and returns the
+ * number of removed cards.
+ */
+extern int card_add(libmtd_t desc, struct registry *reg, int num);
+extern int card_remove(struct registry *reg, int num);
+
+#endif /* CARD_H */
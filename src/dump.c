@@ -0,0 +1,225 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "crc32.h"
+#include "header.h"
+#include "stats.h"
+#include "dump.h"
+
+
+#define min(a,b) ((a)<(b)?(a):(b))
+
+/*
+ * The reader thread fills the two buffers in turn, the writer (the calling
+ * thread) computes the CRC of a full buffer and writes it out while the
+ * reader fills the other one. read and written count the chunks, error is set
+ * by the reader on a read error and stop by the writer on a write error.
+ */
+struct dump {
+	const struct mtd_dev_info *mtd;
+	int fd;
+	size_t size;
+	size_t chunk;
+	char *buf[2];
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	size_t read;
+	size_t written;
+	int error;
+	int stop;
+};
+
+static void *reader(void *arg)
+{
+	struct dump *d = arg;
+	size_t n, offs, len;
+	int stop;
+
+	for (n = 0, offs = 0; offs < d->size; n++, offs += len) {
+		len = min(d->chunk, d->size - offs);
+
+		pthread_mutex_lock(&d->lock);
+		while (d->read - d->written >= 2 && !d->stop)
+			pthread_cond_wait(&d->cond, &d->lock);
+		stop = d->stop;
+		pthread_mutex_unlock(&d->lock);
+		if (stop)
+			break;
+
+		if (mtd_read_multi(d->mtd, d->fd, offs / d->mtd->eb_size, 0,
+		  d->buf[n % 2], len) < 0) {
+			fprintf(stderr, "Error reading mtd%d at offset %zu\n",
+			  d->mtd->mtd_num, offs);
+			pthread_mutex_lock(&d->lock);
+			d->error = 1;
+			pthread_cond_broadcast(&d->cond);
+			pthread_mutex_unlock(&d->lock);
+			break;
+		}
+
+		pthread_mutex_lock(&d->lock);
+		d->read = n + 1;
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+	}
+
+	return NULL;
+}
+
+static int write_all(int fd, const char *buf, size_t len, off_t offs)
+{
+	ssize_t ret;
+
+	for (; len; buf += ret, len -= ret, offs += ret)
+		if ((ret = pwrite(fd, buf, len, offs)) < 0)
+			return -1;
+
+	return 0;
+}
+
+/* Writes the chunks as they are read and sets the CRC of the FW image */
+static int writer(struct dump *d, int ofd, struct header *hdr)
+{
+	size_t n, offs, len;
+	uint32_t crc;
+	int error;
+
+	hdr->crc = 0;
+	crc = crc32_init(0);
+	crc = crc32_block(crc, (const char *)hdr, sizeof(*hdr));
+
+	for (n = 0, offs = 0; offs < d->size; n++, offs += len) {
+		len = min(d->chunk, d->size - offs);
+
+		pthread_mutex_lock(&d->lock);
+		while (d->read <= n && !d->error)
+			pthread_cond_wait(&d->cond, &d->lock);
+		error = d->read <= n;
+		pthread_mutex_unlock(&d->lock);
+		if (error)
+			return -1;
+
+		crc = crc32_block(crc, d->buf[n % 2], len);
+		if (write_all(ofd, d->buf[n % 2], len, sizeof(*hdr) + offs) < 0)
+			return -1;
+
+		pthread_mutex_lock(&d->lock);
+		d->written = n + 1;
+		pthread_cond_broadcast(&d->cond);
+		pthread_mutex_unlock(&d->lock);
+	}
+	hdr->crc = crc32_finish(crc);
+
+	return 0;
+}
+
+int dump_fw(libmtd_t desc, int partition, uint32_t version, size_t size,
+  const char *filename)
+{
+	struct mtd_dev_info mtd;
+	struct dump d = {
+		.mtd = &mtd,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER
+	};
+	struct header hdr;
+	char mtddev[PATH_MAX], tmp[PATH_MAX];
+	pthread_t thread;
+	uint64_t start = stats_now();
+	int ofd, ret = -1;
+
+	if (mtd_dev_node(desc, partition, mtddev, sizeof(mtddev)) < 0) {
+		fprintf(stderr, "MTD device #%d: %s\n", partition, strerror(errno));
+		return -1;
+	}
+	if (mtd_get_dev_info1(desc, partition, &mtd) < 0) {
+		fprintf(stderr, "Error getting MTD device #%d info\n", partition);
+		return -1;
+	}
+	if (!size)
+		size = mtd.size;
+	if (size > mtd.size || size > UINT32_MAX) {
+		fprintf(stderr, "%zu: invalid dump size (mtd%d has %lld bytes)\n",
+		  size, partition, mtd.size);
+		return -1;
+	}
+	d.size = size;
+	d.chunk = (DUMP_CHUNK + mtd.eb_size - 1) / mtd.eb_size * mtd.eb_size;
+
+	if ((d.fd = open(mtddev, O_RDONLY)) < 0) {
+		fprintf(stderr, "Error opening %s: %s\n", mtddev, strerror(errno));
+		return -1;
+	}
+	if (!(d.buf[0] = malloc(d.chunk)) || !(d.buf[1] = malloc(d.chunk))) {
+		fprintf(stderr, "Error allocating dump buffers\n");
+		goto out;
+	}
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", filename) >= sizeof(tmp)) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(ENAMETOOLONG));
+		goto out;
+	}
+	if ((ofd = mkstemp(tmp)) < 0) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		goto out;
+	}
+	if (fchmod(ofd, 0644) < 0) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		goto error_file;
+	}
+
+	if ((errno = pthread_create(&thread, NULL, reader, &d))) {
+		fprintf(stderr, "Error starting dump thread: %s\n", strerror(errno));
+		goto error_file;
+	}
+
+	hdr.magic = FW_MAGIC;
+	hdr.version = version;
+	hdr.size = size;
+	if (writer(&d, ofd, &hdr) < 0) {
+		if (!d.error)
+			fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		pthread_mutex_lock(&d.lock);
+		d.stop = 1;
+		pthread_cond_broadcast(&d.cond);
+		pthread_mutex_unlock(&d.lock);
+		pthread_join(thread, NULL);
+		goto error_file;
+	}
+	pthread_join(thread, NULL);
+
+	/* The image is only complete (and valid) with the header */
+	if (write_all(ofd, (const char *)&hdr, sizeof(hdr), 0) < 0
+	  || fsync(ofd) < 0) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		goto error_file;
+	}
+	if (close(ofd) < 0 || rename(tmp, filename) < 0) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		unlink(tmp);
+		goto out;
+	}
+	stats_add(STATS_READ, start, size);
+
+	printf("mtd%d: %zu bytes dumped to %s (CRC 0x%08x, %.2f MB/s)\n",
+	  partition, size, filename, hdr.crc,
+	  stats_mbps(size, stats_now() - start));
+	ret = 0;
+	goto out;
+
+error_file:
+	close(ofd);
+	unlink(tmp);
+out:
+	free(d.buf[1]);
+	free(d.buf[0]);
+	close(d.fd);
+
+	return ret;
+}
@@ -0,0 +1,21 @@
+#ifndef DUMP_H
+#define DUMP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include "libmtd.h"
+
+/* The size of a dump read (rounded up to whole eraseblocks) */
+#define DUMP_CHUNK 0x100000
+
+/*
+ * Reads the first size bytes (the whole partition if size is 0) of the MTD
+ * device partition and stores them to filename as a FW image with the given
+ * version. The device reads overlap with the file writes and the CRC
+ * computation (double buffering), the header with the CRC is written last and
+ * the file is renamed into place only once complete.
+ */
+extern int dump_fw(libmtd_t desc, int partition, uint32_t version, size_t size,
+  const char *filename);
+
+#endif /* DUMP_H */
@@ -0,0 +1,575 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "probes.h"
+#include "crc32.h"
+#include "header.h"
+#include "stats.h"
+#include "progress.h"
+#include "card.h"
+#include "tune.h"
+#include "health.h"
+#include "flash.h"
+
+
+#define min(a,b) ((a)<(b)?(a):(b))
+#define max(a,b) ((a)>(b)?(a):(b))
+#define DIV_ROUND_UP(n,d) (((n) + (d) - 1) / (d))
+
+/* The smallest calibrated chunk size */
+#define TUNE_CHUNK_MIN 4096
+#define TUNE_CHUNKS_MAX 16
+
+struct card *part_find(const struct registry *reg, uint32_t sn, int card_type)
+{
+	struct card *card;
+
+	if (!(card = card_find(reg, sn)))
+		return NULL;
+	if (card_type != card->type) {
+		fprintf(stderr, "Card/FW type mismatch\n");
+		return NULL;
+	}
+
+	return card;
+}
+
+/*
+ * Adds the write time of the chunk at offset to the eraseblocks it spans, in
+ * proportion to the bytes written to each of them.
+ */
+static void health_write(struct health *h, int eb_size, int offset, int len,
+  uint64_t ns)
+{
+	int block, bs;
+
+	if (!h->write_us)
+		return;
+
+	for (; len > 0; offset += bs, len -= bs) {
+		block = offset / eb_size;
+		bs = min(len, (block + 1) * eb_size - offset);
+		h->write_us[block] += ns * bs / len / 1000;
+		ns -= ns * bs / len;
+	}
+}
+
+static int write_range(const struct mtd_dev_info *mtd, int fd,
+  const char *mtddev, const char *data, int offset, int end, int chunk,
+  struct progress *pg, struct health *h)
+{
+	int ws, eb_size = mtd->eb_size;
+	uint64_t start;
+
+	for (; offset < end; offset += ws) {
+		ws = min(chunk, end - offset);
+		start = stats_now();
+		if (mtd_write_multi(mtd, fd, offset / eb_size, offset % eb_size,
+		  data + offset, ws) < 0) {
+			fprintf(stderr, "Error writing block #%d to %s\n",
+			  offset / eb_size, mtddev);
+			return -1;
+		}
+		health_write(h, eb_size, offset, ws, stats_now() - start);
+		progress_update(pg, DIV_ROUND_UP(offset + ws, eb_size)
+		  - DIV_ROUND_UP(offset, eb_size), ws);
+	}
+
+	return 0;
+}
+
+static int read_range(const struct mtd_dev_info *mtd, int fd,
+  const char *mtddev, char *buf, int offset, int end, int chunk)
+{
+	int rs, eb_size = mtd->eb_size;
+
+	for (; offset < end; offset += rs, buf += rs) {
+		rs = min(chunk, end - offset);
+		if (mtd_read_multi(mtd, fd, offset / eb_size, offset % eb_size, buf,
+		  rs) < 0) {
+			fprintf(stderr, "Error reading block #%d from %s\n",
+			  offset / eb_size, mtddev);
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Writes the beginning of the FW data in equally sized segments, each with a
+ * different chunk size, and reads the segments back the same way (verifying
+ * them). The chunk sizes with the best throughput are saved for the card type
+ * and eraseblock size. Returns the number of bytes written or -1 on error.
+ */
+static int calibrate(const struct mtd_dev_info *mtd, int fd, const char *mtddev,
+  const char *data, int size, struct progress *pg, struct health *h,
+  const char *tfile)
+{
+	int chunks[TUNE_CHUNKS_MAX], seg = TUNE_EB_MAX * mtd->eb_size;
+	double wr[TUNE_CHUNKS_MAX], rd[TUNE_CHUNKS_MAX];
+	int c, i, cnt = 0, best_wr = 0, best_rd = 0;
+	struct tune tune;
+	uint64_t start;
+	char *buf;
+
+	/* A bogus (non-positive) sysfs min_io_size must not loop forever */
+	for (c = max(mtd->min_io_size, 1); c < TUNE_CHUNK_MIN; c *= 2)
+		;
+	for (; c <= seg && cnt < TUNE_CHUNKS_MAX; c *= 2)
+		if (!(seg % c))
+			chunks[cnt++] = c;
+	if (!cnt || cnt * seg > size) {
+		fprintf(stderr, "FW image too small for calibration (%d bytes "
+		  "required)\n", cnt * seg);
+		return -1;
+	}
+
+	for (i = 0; i < cnt; i++) {
+		start = stats_now();
+		if (write_range(mtd, fd, mtddev, data, i * seg, (i + 1) * seg,
+		  chunks[i], pg, h) < 0)
+			return -1;
+		wr[i] = stats_mbps(seg, stats_now() - start);
+	}
+
+	if (!(buf = malloc(seg))) {
+		fprintf(stderr, "Error allocating calibration buffer\n");
+		return -1;
+	}
+	for (i = 0; i < cnt; i++) {
+		start = stats_now();
+		if (read_range(mtd, fd, mtddev, buf, i * seg, (i + 1) * seg,
+		  chunks[i]) < 0)
+			goto error;
+		rd[i] = stats_mbps(seg, stats_now() - start);
+		if (memcmp(buf, data + i * seg, seg)) {
+			fprintf(stderr, "%s: data verification failed\n", mtddev);
+			goto error;
+		}
+	}
+	free(buf);
+
+	printf("%-10s %14s %14s\n", "chunk", "write [MB/s]", "read [MB/s]");
+	for (i = 0; i < cnt; i++) {
+		printf("%-10d %14.2f %14.2f\n", chunks[i], wr[i], rd[i]);
+		if (wr[i] > wr[best_wr])
+			best_wr = i;
+		if (rd[i] > rd[best_rd])
+			best_rd = i;
+	}
+
+	tune.write_chunk = chunks[best_wr];
+	tune.read_chunk = chunks[best_rd];
+	if (tune_store(tfile, card_type(mtd->size), mtd->eb_size, &tune) < 0)
+		fprintf(stderr, "Error writing %s: %s\n", tfile, strerror(errno));
+	else
+		printf("write chunk: %d, read chunk: %d (saved to %s)\n",
+		  tune.write_chunk, tune.read_chunk, tfile);
+
+	return cnt * seg;
+
+error:
+	free(buf);
+
+	return -1;
+}
+
+/* The FW data bytes in eraseblock block, the rest of the block is 0xff */
+static int block_data(const struct mtd_dev_info *mtd, int block, int size)
+{
+	return max(min(size - block * mtd->eb_size, mtd->eb_size), 0);
+}
+
+/* Whether the eraseblock content buf differs from the FW data of the block */
+static int block_changed(const struct mtd_dev_info *mtd, int block,
+  const char *buf, const char *data, int size)
+{
+	int len = block_data(mtd, block, size);
+
+	return memcmp(buf, data + block * mtd->eb_size, len)
+	  || mtd_check_pattern(buf + len, 0xff, mtd->eb_size - len) >= 0;
+}
+
+/*
+ * Restores the erased eraseblocks 0..erased - 1 that were changed from the
+ * backup, skipping the writes of the blocks that were empty.
+ */
+static int restore(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+  const char *mtddev, const char *backup, const char *changed, int erased,
+  char *buf)
+{
+	const char *old;
+	int block, cnt = 0, ret = 0;
+
+	for (block = 0; block < erased; block++)
+		cnt += changed[block];
+	fprintf(stderr, "%s: restoring %d eraseblocks from the backup\n", mtddev,
+	  cnt);
+
+	for (block = 0; block < erased; block++) {
+		if (!changed[block])
+			continue;
+		old = backup + (size_t)block * mtd->eb_size;
+		if (mtd_erase(desc, mtd, fd, block) < 0
+		  || (mtd_check_pattern(old, 0xff, mtd->eb_size) >= 0
+		  && mtd_write_multi(mtd, fd, block, 0, old, mtd->eb_size) < 0)
+		  || mtd_read(mtd, fd, block, 0, buf, mtd->eb_size) < 0
+		  || memcmp(buf, old, mtd->eb_size)) {
+			fprintf(stderr, "%s: error restoring block #%d\n", mtddev,
+			  block);
+			ret = -1;
+		}
+	}
+	if (!ret)
+		fprintf(stderr, "%s: previous content restored\n", mtddev);
+
+	return ret;
+}
+
+/*
+ * Transactional flashing: backs up the partition, erases and writes only the
+ * eraseblocks whose content changes, verifies them and restores them from the
+ * backup on any error.
+ */
+static int flash_tx(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+  const char *mtddev, const char *data, int size, struct progress *pg,
+  struct health *h, const char *tfile)
+{
+	int block, len, cnt = 0, bytes = 0, erased = 0, ret = -1;
+	char *backup, *changed = NULL, *buf = NULL;
+	struct tune tune;
+	uint64_t start, t;
+
+	if (size > mtd->size) {
+		fprintf(stderr, "%s: FW data larger than the partition\n", mtddev);
+		return -1;
+	}
+	if (tune_load(tfile, card_type(mtd->size), mtd->eb_size, &tune) < 0)
+		tune.write_chunk = tune.read_chunk = mtd->eb_size;
+
+	if (!(backup = malloc(mtd->size)) || !(changed = malloc(mtd->eb_cnt))
+	  || !(buf = malloc(mtd->eb_size))) {
+		fprintf(stderr, "Error allocating backup memory\n");
+		goto out;
+	}
+	start = stats_now();
+	if (read_range(mtd, fd, mtddev, backup, 0, mtd->size,
+	  tune.read_chunk) < 0)
+		goto out;
+	stats_add(STATS_READ, start, mtd->size);
+
+	for (block = 0; block < mtd->eb_cnt; block++) {
+		changed[block] = block_changed(mtd, block,
+		  backup + (size_t)block * mtd->eb_size, data, size);
+		cnt += changed[block];
+		bytes += changed[block] ? block_data(mtd, block, size) : 0;
+	}
+
+	progress_phase(pg, PROGRESS_ERASE, cnt, (uint64_t)cnt * mtd->eb_size);
+	start = stats_now();
+	for (block = 0; block < mtd->eb_cnt; block++) {
+		if (!changed[block])
+			continue;
+		t = stats_now();
+		erased = block + 1;
+		if (mtd_erase(desc, mtd, fd, block) < 0) {
+			fprintf(stderr, "Error erasing block #%d of %s\n", block,
+			  mtddev);
+			goto error_restore;
+		}
+		if (h->erase_us)
+			h->erase_us[block] = max((stats_now() - t) / 1000, 1);
+		progress_update(pg, 1, mtd->eb_size);
+	}
+	stats_add(STATS_ERASE, start, (uint64_t)cnt * mtd->eb_size);
+
+	progress_phase(pg, PROGRESS_WRITE, cnt, bytes);
+	start = stats_now();
+	for (block = 0; block < mtd->eb_cnt; block++) {
+		if (!changed[block])
+			continue;
+		if (!(len = block_data(mtd, block, size))) {
+			progress_update(pg, 1, 0);
+			continue;
+		}
+		if (write_range(mtd, fd, mtddev, data, block * mtd->eb_size,
+		  block * mtd->eb_size + len, tune.write_chunk, pg, h) < 0)
+			goto error_restore;
+	}
+	stats_add(STATS_WRITE, start, bytes);
+
+	progress_phase(pg, PROGRESS_VERIFY, cnt, (uint64_t)cnt * mtd->eb_size);
+	for (block = 0; block < mtd->eb_cnt; block++) {
+		if (!changed[block])
+			continue;
+		if (mtd_read(mtd, fd, block, 0, buf, mtd->eb_size) < 0) {
+			fprintf(stderr, "Error reading block #%d from %s\n", block,
+			  mtddev);
+			goto error_restore;
+		}
+		if (block_changed(mtd, block, buf, data, size)) {
+			fprintf(stderr, "%s: block #%d verification failed\n", mtddev,
+			  block);
+			goto error_restore;
+		}
+		progress_update(pg, 1, mtd->eb_size);
+	}
+
+	ret = 0;
+	goto out;
+
+error_restore:
+	restore(desc, mtd, fd, mtddev, backup, changed, erased, buf);
+out:
+	free(buf);
+	free(changed);
+	free(backup);
+
+	return ret;
+}
+
+int flash_fw(libmtd_t desc, int partition, uint32_t sn, const char *data,
+  int size, const struct flash_opts *opts)
+{
+	struct mtd_dev_info dev_info;
+	struct progress pg;
+	struct tune tune;
+	struct health h = {0};
+	const char *tfile = opts->tune_file ? opts->tune_file : tune_file;
+	const char *hdir = opts->health_dir ? opts->health_dir : health_dir;
+	char mtddev[PATH_MAX];
+	int fd, ret = -1;
+	int block, chunk, offset = 0;
+	uint64_t start, t;
+
+	PROBE(fw_flash, flash_start, partition, size);
+	progress_init(&pg, opts->progress_fd, opts->progress_cb,
+	  opts->progress_arg, sn, partition);
+
+	if (mtd_dev_node(desc, partition, mtddev, sizeof(mtddev)) < 0) {
+		fprintf(stderr, "MTD device #%d: %s\n", partition, strerror(errno));
+		goto out;
+	}
+	if ((fd = open(mtddev, O_RDWR)) < 0) {
+		fprintf(stderr, "Error opening %s: %s\n", mtddev, strerror(errno));
+		goto out;
+	}
+
+	if (mtd_get_dev_info1(desc, partition, &dev_info) < 0) {
+		fprintf(stderr, "Error getting MTD device #%d info\n", partition);
+		goto out_fd;
+	}
+
+	/* The eraseblock times are recorded even if the flashing fails */
+	if (health_init(&h, partition, dev_info.eb_cnt) < 0)
+		fprintf(stderr, "Error allocating health record, not recording\n");
+
+	if (opts->rollback) {
+		ret = flash_tx(desc, &dev_info, fd, mtddev, data, size, &pg, &h,
+		  tfile);
+		goto out_fd;
+	}
+
+	/* Erase block by block to measure each eraseblock erase time */
+	progress_phase(&pg, PROGRESS_ERASE, dev_info.eb_cnt, dev_info.size);
+	start = stats_now();
+	for (block = 0; block < dev_info.eb_cnt; block++) {
+		t = stats_now();
+		if (mtd_erase_multi(desc, &dev_info, fd, block, 1) < 0) {
+			fprintf(stderr, "Error erasing %s\n", mtddev);
+			goto out_fd;
+		}
+		/* Zero means not erased */
+		if (h.erase_us)
+			h.erase_us[block] = max((stats_now() - t) / 1000, 1);
+		progress_update(&pg, 1, dev_info.eb_size);
+	}
+	stats_add(STATS_ERASE, start, dev_info.size);
+
+	progress_phase(&pg, PROGRESS_WRITE,
+	  DIV_ROUND_UP(size, dev_info.eb_size), size);
+	start = stats_now();
+	if (opts->calibrate) {
+		if ((offset = calibrate(&dev_info, fd, mtddev, data, size, &pg,
+		  &h, tfile)) < 0)
+			goto out_fd;
+	}
+	if (tune_load(tfile, card_type(dev_info.size), dev_info.eb_size, &tune)
+	  < 0)
+		chunk = dev_info.eb_size;
+	else
+		chunk = tune.write_chunk;
+	if (write_range(&dev_info, fd, mtddev, data, offset, size, chunk, &pg,
+	  &h) < 0)
+		goto out_fd;
+	stats_add(STATS_WRITE, start, size);
+
+	ret = 0;
+
+out_fd:
+	close(fd);
+	if (h.erase_us && health_store(hdir, sn, &h) < 0)
+		fprintf(stderr, "Error writing %s health record: %s\n", mtddev,
+		  strerror(errno));
+	health_free(&h);
+out:
+	progress_done(&pg, ret);
+	PROBE(fw_flash, flash_done, partition, size, ret);
+
+	return ret;
+}
+
+/* Validates the FW header magic and the FW data size of the card type */
+static int check_header(const char *name, const struct header *hdr)
+{
+	size_t limit;
+
+	if (hdr->magic != FW_MAGIC) {
+		fprintf(stderr, "%s: Not a mgb4 FW file\n", name);
+		return -1;
+	}
+	limit = (((hdr->version >> 16) & 0xff) <= 1) ? 0x400000 : 0x950000;
+	if (hdr->size > limit) {
+		fprintf(stderr, "%s: %u: Invalid FW data size\n", name, hdr->size);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* The CRC is computed over the header (with zero CRC) and the FW data */
+static uint32_t fw_crc(struct header hdr, const char *data, size_t size)
+{
+	uint32_t crc;
+
+	hdr.crc = 0;
+	crc = crc32_init(0);
+	crc = crc32_block(crc, (const char *)&hdr, sizeof(hdr));
+	crc = crc32_block(crc, data, size);
+
+	return crc32_finish(crc);
+}
+
+int read_fw(const char *filename, char **data, size_t *size,
+  uint32_t *version)
+{
+	int fd;
+	struct header hdr;
+	uint32_t crc;
+	ssize_t rs;
+	uint64_t start = stats_now();
+
+	PROBE(fw_flash, read_fw_start, filename);
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		fprintf(stderr, "%s: Error opening input file\n", filename);
+		goto error;
+	}
+
+	if (read(fd, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+		fprintf(stderr, "%s: Not a mgb4 FW file\n", filename);
+		goto error_fd;
+	}
+	if (check_header(filename, &hdr) < 0)
+		goto error_fd;
+
+	*size = hdr.size;
+	*version = hdr.version;
+
+	if (!(*data = malloc(*size))) {
+		fprintf(stderr, "Error allocating FW data memory\n");
+		goto error_fd;
+	}
+	if ((rs = read(fd, *data, *size)) < *size) {
+		if (rs < 0)
+			fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		else
+			fprintf(stderr, "%s: unexpected EOF\n", filename);
+		goto error_alloc;
+	}
+
+	close(fd);
+	stats_add(STATS_READ, start, sizeof(hdr) + *size);
+
+	start = stats_now();
+	crc = fw_crc(hdr, *data, *size);
+	stats_add(STATS_CRC, start, *size);
+
+	if (crc != hdr.crc) {
+		fprintf(stderr, "%s: CRC error\n", filename);
+		free(*data);
+		goto error;
+	}
+
+	PROBE(fw_flash, read_fw_done, filename, *size, 0);
+
+	return 0;
+
+error_alloc:
+	free(*data);
+error_fd:
+	close(fd);
+error:
+	PROBE(fw_flash, read_fw_done, filename, 0, -1);
+
+	return -1;
+}
+
+int parse_fw(const char *name, const char *buf, size_t len,
+  const char **data, size_t *size, uint32_t *version)
+{
+	struct header hdr;
+
+	if (len < sizeof(hdr)) {
+		fprintf(stderr, "%s: Not a mgb4 FW file\n", name);
+		return -1;
+	}
+	memcpy(&hdr, buf, sizeof(hdr));
+	if (check_header(name, &hdr) < 0)
+		return -1;
+	if (len - sizeof(hdr) < hdr.size) {
+		fprintf(stderr, "%s: unexpected EOF\n", name);
+		return -1;
+	}
+	if (fw_crc(hdr, buf + sizeof(hdr), hdr.size) != hdr.crc) {
+		fprintf(stderr, "%s: CRC error\n", name);
+		return -1;
+	}
+
+	*data = buf + sizeof(hdr);
+	*size = hdr.size;
+	*version = hdr.version;
+
+	return 0;
+}
+
+void fw_info(FILE *fp, uint32_t version, size_t size)
+{
+	const char *fw_type, *card_type;
+
+	switch (version >> 24) {
+		case 1:
+			fw_type = "FPDL3";
+			break;
+		case 2:
+			fw_type = "GMSL3";
+			break;
+		case 3:
+			fw_type = "GMSL1";
+			break;
+		case 4:
+			fw_type = "FPDL4";
+			break;
+		default:
+			fw_type = "UNKNOWN";
+	}
+	card_type = (((version >> 16) & 0xff) == 1)
+	  ? "T100" : (((version >> 16) & 0xff) == 2) ? "T200" : "UNKNOWN";
+	fprintf(fp, "card: %s\ntype: %s\nversion: %u\nsize: %zu\n",
+	  card_type, fw_type, version & 0xFFFF, size);
+}
@@ -0,0 +1,61 @@
+#ifndef FLASH_H
+#define FLASH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "libmtd.h"
+#include "fwflash.h"
+#include "card.h"
+
+/*
+ * Returns the card with serial number sn (or the only card present if sn is 0)
+ * if its type matches card_type, NULL otherwise.
+ */
+extern struct card *part_find(const struct registry *reg, uint32_t sn,
+  int card_type);
+
+/*
+ * Loads and validates (header, size and CRC) the FW image filename. On success
+ * *data holds the FW data (without the header) and must be freed by the caller.
+ */
+extern int read_fw(const char *filename, char **data, size_t *size,
+  uint32_t *version);
+
+/*
+ * Validates the FW image (header, size and CRC) of len bytes in buf. On success
+ * *data points to the FW data in buf. name is used in the error messages.
+ */
+extern int parse_fw(const char *name, const char *buf, size_t len,
+  const char **data, size_t *size, uint32_t *version);
+
+/*
+ * Flashing options: the progress of the card is reported to progress_fd
+ * unless it is -1 and to progress_cb if set (see progress.h), with calibrate
+ * set the write/read chunk sizes are calibrated while flashing (see tune.h).
+ * With rollback set, the partition is backed up to memory first, only the
+ * eraseblocks that change are erased and written, they are verified and if
+ * anything fails, the erased blocks are restored from the backup (rollback
+ * and calibrate are exclusive). The calibration is read from and stored to
+ * tune_file and the health record to health_dir, the process-wide defaults
+ * of tune.h and health.h if NULL.
+ */
+struct flash_opts {
+	int progress_fd;
+	fwflash_progress_cb progress_cb;
+	void *progress_arg;
+	int calibrate;
+	int rollback;
+	const char *tune_file;
+	const char *health_dir;
+};
+
+/*
+ * Erases the MTD device partition and writes the FW data to it, using the
+ * calibrated write chunk size of the card type if available.
+ */
+extern int flash_fw(libmtd_t desc, int partition, uint32_t sn, const char *data,
+  int size, const struct flash_opts *opts);
+
+extern void fw_info(FILE *fp, uint32_t version, size_t size);
+
+#endif /* FLASH_H */
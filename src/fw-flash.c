@@ -2,303 +2,319 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <limits.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <sys/queue.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <signal.h>
+#include <grp.h>
 #include "libmtd.h"
-#include "crc32.h"
-#include "header.h"
+#include "card.h"
+#include "cache.h"
+#include "monitor.h"
+#include "stats.h"
+#include "flash.h"
+#include "server.h"
+#include "tune.h"
+#include "health.h"
+#include "selftest.h"
+#include "metrics.h"
+#include "scan.h"
+#include "dump.h"
 
 
 #define VERSION "1.2"
 
-#define DATA_PART_NAME "mgb4-data"
-#define FW_PART_NAME   "mgb4-fw"
-
-#define min(a,b) ((a)<(b)?(a):(b))
-
-struct entry {
-	int num;
-	uint32_t sn;
-	int type;
-	LIST_ENTRY(entry) entries;
+enum {
+	OPT_STATS = 0x100,
+	OPT_MTD_STATS,
+	OPT_PROGRESS,
+	OPT_SERVER,
+	OPT_CLIENT,
+	OPT_CALIBRATE,
+	OPT_HEALTH,
+	OPT_SELFTEST,
+	OPT_SELFTEST_BLOCKS,
+	OPT_SAVE_BASELINE,
+	OPT_METRICS,
+	OPT_SCAN,
+	OPT_DUMP,
+	OPT_DUMP_VERSION,
+	OPT_DUMP_SIZE,
+	OPT_ROLLBACK,
+	OPT_SERVER_GROUP
 };
 
-LIST_HEAD(list, entry);
+static const char *emu_root;
+static struct flash_opts flash_opts = {.progress_fd = -1};
 
 static libmtd_t mtd_open()
 {
 	libmtd_t desc;
+	uint64_t start = stats_now();
 
-	if (!(desc = libmtd_open())) {
+	if (!(desc = emu_root ? libmtd_open_emu(emu_root) : libmtd_open())) {
 		if (errno)
 			fprintf(stderr, "MTD: %s\n", strerror(errno));
 		else
 			fprintf(stderr, "MTD not present\n");
 	}
+	stats_add(STATS_OPEN, start, 0);
 
 	return desc;
 }
 
-static void free_list(struct list *head)
+static int card_list(libmtd_t desc, struct registry *reg, int use_cache)
 {
-	struct entry *n1, *n2;
+	struct cache cache;
+	uint64_t start = stats_now();
+	int ret = 0;
 
-	n1 = LIST_FIRST(head);
-	while (n1 != NULL) {
-		n2 = LIST_NEXT(n1, entries);
-		free(n1);
-		n1 = n2;
+	if (!use_cache) {
+		ret = part_list(desc, reg);
+		goto out;
 	}
+
+	if (!cache_load(desc, &cache, reg))
+		goto out_cache;
+	if ((ret = part_list(desc, reg)) < 0)
+		goto out_cache;
+	cache_store(&cache, reg);
+
+out_cache:
+	cache_free(&cache);
+out:
+	stats_add(STATS_LIST, start, 0);
+
+	return ret;
 }
 
-static int part_list(libmtd_t desc, struct list *head)
+static int list_devices(int use_cache)
 {
-	struct mtd_info info;
-	struct mtd_dev_info dev_info;
-	int i, fd, partition = -1;
-	char mtddev[32];
-	uint32_t sn;
-	long long size = 0;
-	struct entry *card;
+	libmtd_t desc;
+	struct registry reg = REGISTRY_INIT;
 
 
-	if (mtd_get_info(desc, &info) < 0) {
-		fprintf(stderr, "Error reading MTD info\n");
+	if (!(desc = mtd_open()))
 		return -1;
-	}
+	if (card_list(desc, &reg, use_cache) < 0)
+		goto error_mtd;
+	list_print(stdout, &reg);
+	libmtd_close(desc);
+	registry_free(&reg);
+	fflush(stdout);
+	stats_print(stderr);
 
-	for (i = info.lowest_mtd_num; i <= info.highest_mtd_num; i++) {
-		if (mtd_get_dev_info1(desc, i, &dev_info) < 0) {
-			fprintf(stderr, "Error getting MTD device #%d info\n", i);
-			goto error;
-		}
+	return 0;
 
-		if (!strncmp(dev_info.name, FW_PART_NAME, strlen(FW_PART_NAME))) {
-			partition = i;
-			size = dev_info.size;
-			continue;
-		}
-		if (strncmp(dev_info.name, DATA_PART_NAME, strlen(DATA_PART_NAME)))
-			continue;
-		if (partition != i - 1) {
-			fprintf(stderr, "Partition order mismatch\n");
-			goto error;
-		}
-		if (size != 0x400000 && size != 0x950000) {
-			fprintf(stderr, "Unknown FW partition size (%lld)\n", size);
-			goto error;
-		}
+error_mtd:
+	registry_free(&reg);
+	libmtd_close(desc);
 
-		snprintf(mtddev, sizeof(mtddev), "/dev/mtd%d", i);
-		if ((fd = open(mtddev, O_RDONLY)) < 0) {
-			fprintf(stderr, "Error opening %s: %s\n", mtddev, strerror(errno));
-			goto error;
-		}
-		if (mtd_read(&dev_info, fd, 0, 0, &sn, sizeof(sn)) < 0) {
-			fprintf(stderr, "Error reading %s\n", mtddev);
-			close(fd);
-			goto error;
-		}
-		close(fd);
-
-		if (!(card = malloc(sizeof(struct entry))))
-			goto error;
-		card->num = partition;
-		card->sn = sn;
-		card->type = (size == 0x950000) ? 2 : 1;
-		LIST_INSERT_HEAD(head, card, entries);
-	}
+	return -1;
+}
 
-	return 0;
+static int monitor_devices(const char *path)
+{
+	libmtd_t desc;
+	int ret;
 
-error:
-	free_list(head);
-	return -1;
+	if (!(desc = mtd_open()))
+		return -1;
+	ret = monitor(desc, path);
+	libmtd_close(desc);
+
+	return ret;
 }
 
-static int part_find(struct list *head, uint32_t sn, int card_type)
+static int serve(const char *path, const char *uevent_path, gid_t gid)
 {
-	struct entry *np, *fp = 0;
-	int cnt = 0;
-
-	LIST_FOREACH(np, head, entries) {
-		if (sn == np->sn) {
-			if (card_type != np->type) {
-				fprintf(stderr, "Card/FW type mismatch\n");
-				return -1;
-			} else
-				return np->num;
-		}
-		fp = np;
-		cnt++;
-	}
+	libmtd_t desc;
+	int ret;
 
-	if (!sn && cnt == 1) {
-		if (card_type != fp->type) {
-			fprintf(stderr, "Card/FW type mismatch\n");
-			return -1;
-		} else
-			return fp->num;
-	}
+	/* The phase statistics are process wide, not per request */
+	stats_format = STATS_NONE;
 
-	if (sn)
-		fprintf(stderr, "0x%x: card not found\n", sn);
-	else if (!sn && cnt > 1)
-		fprintf(stderr, "Card not specified (multiple cards present)\n");
-	else
-		fprintf(stderr, "No card found\n");
+	if (!(desc = mtd_open()))
+		return -1;
+	ret = server(desc, path, uevent_path, gid);
+	libmtd_close(desc);
 
-	return -1;
+	return ret;
 }
 
-static int flash_fw(libmtd_t desc, int partition, const char *data, int size)
+static int request(const char *path, int list, int info, uint32_t sn,
+  const char *filename)
 {
-	struct mtd_dev_info dev_info;
-	char mtddev[32];
-	int fd;
-	int block, ws, offset = 0;
-
-	snprintf(mtddev, sizeof(mtddev), "/dev/mtd%d", partition);
-	if ((fd = open(mtddev, O_WRONLY)) < 0) {
-		fprintf(stderr, "Error opening %s: %s\n", mtddev, strerror(errno));
-		return -1;
-	}
+	char req[PATH_MAX + 32], fw[PATH_MAX], sns[16];
 
-	if (mtd_get_dev_info1(desc, partition, &dev_info) < 0) {
-		fprintf(stderr, "Error getting MTD device #%d info\n", partition);
-		goto error;
-	}
+	if (list)
+		return client(path, "list", flash_opts.progress_fd);
 
-	if (mtd_erase_multi(desc, &dev_info, fd, 0, dev_info.eb_cnt) < 0) {
-		fprintf(stderr, "Error erasing %s\n", mtddev);
-		goto error;
+	/* The FW file is opened by the server */
+	if (!realpath(filename, fw)) {
+		fprintf(stderr, "%s: %s\n", filename, strerror(errno));
+		return -1;
 	}
-
-	while (offset < size) {
-		block = offset / dev_info.eb_size;
-		ws = min(dev_info.eb_size, size - (block * dev_info.eb_size));
-		if (mtd_write(desc, &dev_info, fd, block, 0, (void*)data + offset, ws,
-		  0, 0, 0) < 0) {
-			fprintf(stderr, "Error writing block #%d to %s\n", block, mtddev);
-			goto error;
-		}
-		offset += dev_info.eb_size;
+	if (info)
+		snprintf(req, sizeof(req), "info %s", fw);
+	else {
+		if (sn)
+			sn2str(sn, sns, sizeof(sns));
+		snprintf(req, sizeof(req), "flash %s %s%s", sn ? sns : "-",
+		  flash_opts.rollback ? "rollback " : "", fw);
 	}
 
-	close(fd);
+	return client(path, req, flash_opts.progress_fd);
+}
 
-	return 0;
+static int selftest_card(int use_cache, uint32_t sn,
+  const struct selftest_opts *opts)
+{
+	libmtd_t desc;
+	struct registry reg = REGISTRY_INIT;
+	struct card *card;
+	int ret = -1;
 
-error:
-	close(fd);
+	if (!(desc = mtd_open()))
+		return -1;
+	if (card_list(desc, &reg, use_cache) < 0)
+		goto out;
+	if ((card = card_find(&reg, sn)))
+		ret = selftest(desc, card->fw_num, card->type, opts, stdout);
+out:
+	registry_free(&reg);
+	libmtd_close(desc);
 
-	return -1;
+	return ret;
 }
 
-static int read_fw(const char *filename, char **data, size_t *size,
-  uint32_t *version)
+static int scan_card(int use_cache, uint32_t sn, int first, int last)
 {
-	int fd;
-	struct header hdr;
-	uint32_t crc, crc_check;
-	ssize_t rs;
-	size_t limit;
-
+	libmtd_t desc;
+	struct registry reg = REGISTRY_INIT;
+	struct card *card;
+	int ret = -1;
 
-	if ((fd = open(filename, O_RDONLY)) < 0) {
-		fprintf(stderr, "%s: Error opening input file\n", filename);
+	if (!(desc = mtd_open()))
 		return -1;
-	}
+	if (card_list(desc, &reg, use_cache) < 0)
+		goto out;
+	if ((card = card_find(&reg, sn)))
+		ret = scan(desc, card->fw_num, card->type, first, last, stdout);
+out:
+	registry_free(&reg);
+	libmtd_close(desc);
+
+	return ret;
+}
 
-	if (read(fd, &hdr, sizeof(hdr)) < sizeof(hdr) || hdr.magic != FW_MAGIC) {
-		fprintf(stderr, "%s: Not a mgb4 FW file\n", filename);
+/*
+ * The card type of the dumped image is the type of the card unless the version
+ * sets it.
+ */
+static int dump_card(int use_cache, uint32_t sn, uint32_t version, size_t size,
+  const char *filename)
+{
+	libmtd_t desc;
+	struct registry reg = REGISTRY_INIT;
+	struct card *card;
+	int ret = -1;
+
+	if (!(desc = mtd_open()))
 		return -1;
+	if (card_list(desc, &reg, use_cache) < 0)
+		goto out;
+	if ((card = card_find(&reg, sn))) {
+		if (!(version & 0xff0000))
+			version |= card->type << 16;
+		stats_card(card->sn, card->fw_num);
+		if (!(ret = dump_fw(desc, card->fw_num, version, size, filename))) {
+			fflush(stdout);
+			stats_print(stderr);
+		}
 	}
-	limit = (((hdr.version >> 16) & 0xff) <= 1) ? 0x400000 : 0x950000;
-	if (hdr.size > limit) {
-		fprintf(stderr, "%s: %u: Invalid FW data size\n", filename, hdr.size);
-		goto error_fd;
-	}
+out:
+	registry_free(&reg);
+	libmtd_close(desc);
 
-	*size = hdr.size;
-	*version = hdr.version;
-	crc_check = hdr.crc;
-	hdr.crc = 0;
+	return ret;
+}
 
-	crc = crc32_init(0);
-	crc = crc32_block(crc, (const char *)&hdr, sizeof(hdr));
+static void mtd_stats_print(void)
+{
+	mtd_stats_dump(stderr);
+}
 
-	if (!(*data = malloc(*size))) {
-		fprintf(stderr, "Error allocating FW data memory\n");
-		goto error_fd;
+static int str2fd(const char *str, int *fd)
+{
+	char *end;
+	long val;
+
+	errno = 0;
+	val = strtol(str, &end, 10);
+	if (errno || *end || end == str || val < 0 || val > INT_MAX) {
+		fprintf(stderr, "%s: invalid file descriptor\n", str);
+		return -1;
 	}
-	if ((rs = read(fd, *data, *size)) < *size) {
-		if (rs < 0)
-			fprintf(stderr, "%s: %s\n", filename, strerror(errno));
-		else
-			fprintf(stderr, "%s: unexpected EOF\n", filename);
-		goto error_alloc;
+	if (fcntl(val, F_GETFD) < 0) {
+		fprintf(stderr, "%s: %s\n", str, strerror(errno));
+		return -1;
 	}
 
-	close(fd);
+	*fd = val;
 
-	crc = crc32_block(crc, *data, *size);
-	crc = crc32_finish(crc);
+	return 0;
+}
 
-	if (crc != crc_check) {
-		fprintf(stderr, "%s: CRC error\n", filename);
-		goto error_alloc;
-	}
+static int str2u32(const char *str, const char *what, uint32_t *val)
+{
+	char *end;
+	unsigned long long v;
 
-	return 0;
+	errno = 0;
+	v = strtoull(str, &end, 0);
+	if (errno || *end || end == str || *str == '-' || v > UINT32_MAX) {
+		fprintf(stderr, "%s: invalid %s\n", str, what);
+		return -1;
+	}
 
-error_alloc:
-	free(*data);
-error_fd:
-	close(fd);
+	*val = v;
 
-	return -1;
+	return 0;
 }
 
-static int list_devices()
+static int str2gid(const char *str, gid_t *gid)
 {
-	libmtd_t desc;
-	struct entry *np;
-	struct list head;
-	LIST_INIT(&head);
+	struct group *gr;
+	uint32_t val;
 
-
-	if (!(desc = mtd_open()))
+	if ((gr = getgrnam(str))) {
+		*gid = gr->gr_gid;
+		return 0;
+	}
+	if (str2u32(str, "group", &val) < 0 || val == (gid_t)-1)
 		return -1;
-	if (part_list(desc, &head) < 0)
-		goto error_mtd;
-	LIST_FOREACH(np, &head, entries)
-		printf("%03d-%03d-%03d-%03d (%s)\n", np->sn >> 24, (np->sn >> 16) & 0xFF,
-		  (np->sn >>8) & 0xFF, np->sn & 0xFF, np->type == 2 ? "T200" : "T100");
-	libmtd_close(desc);
-	free_list(&head);
+	*gid = val;
 
 	return 0;
-
-error_mtd:
-	libmtd_close(desc);
-
-	return -1;
 }
 
-static int str2sn(const char *str, uint32_t *sn)
+static int str2ms(const char *str, unsigned *ms)
 {
-	unsigned b0, b1, b2, b3;
+	char *end;
+	long val;
 
-	if (sscanf(str, "%03u-%03u-%03u-%03u", &b3, &b2, &b1, &b0) < 4) {
-		fprintf(stderr, "%s: invalid serial number\n", str);
+	errno = 0;
+	val = strtol(str, &end, 10);
+	if (errno || *end || end == str || val <= 0 || val > 3600000) {
+		fprintf(stderr, "%s: invalid interval\n", str);
 		return -1;
 	}
 
-	*sn = (b3 << 24) | (b2 << 16) | (b1 << 8) | b0;
+	*ms = val;
 
 	return 0;
 }
@@ -307,29 +323,127 @@ static void usage(const char *cmd)
 {
 	fprintf(stderr, "%s - mgb4 firmware flash tool.\n\n", cmd);
 	fprintf(stderr, "Usage:\n");
-	fprintf(stderr, "%s [-s SN] FILE\n", cmd);
+	fprintf(stderr, "%s [-E DIR] [-c] [-s SN] FILE\n", cmd);
 	fprintf(stderr, "%s -i FILE\n", cmd);
-	fprintf(stderr, "%s -l\n", cmd);
+	fprintf(stderr, "%s [-E DIR] [-c] -l\n", cmd);
+	fprintf(stderr, "%s [-E DIR] [-U SOCK] -m\n", cmd);
+	fprintf(stderr, "%s [-E DIR] [-U SOCK] --server=SOCK [--server-group=GROUP]\n",
+	  cmd);
+	fprintf(stderr, "%s --client=SOCK [-l | -i FILE | [-s SN] FILE]\n", cmd);
+	fprintf(stderr, "%s [-E DIR] [-s SN] --health\n", cmd);
+	fprintf(stderr, "%s [-E DIR] [-c] [-s SN] --selftest "
+	  "[--selftest-blocks=FIRST-LAST] [--save-baseline]\n", cmd);
+	fprintf(stderr, "%s [-E DIR] [-c] [-s SN] --scan[=FIRST-LAST]\n", cmd);
+	fprintf(stderr, "%s [-E DIR] [-c] [-s SN] --dump=FILE [--dump-version=VERSION] "
+	  "[--dump-size=SIZE]\n", cmd);
 	fprintf(stderr, "%s -v\n\n", cmd);
 	fprintf(stderr, "Options:\n");
+	fprintf(stderr, "  -E DIR   Use the MTD emulator tree in DIR instead of the system\n"
+	  "           MTD devices (see scripts/make-emu.sh)\n");
+	fprintf(stderr, "  -c       Use the card inventory cache (" CACHE_FILE ")\n");
 	fprintf(stderr, "  -s SN    Flash card serial number SN\n");
 	fprintf(stderr, "  -i FILE  Show firmware info and exit\n");
-	fprintf(stderr, "  -l       List available devices (SNs) and exit\n");
+	fprintf(stderr, "  -l       List available devices (SNs, by card type and SN)\n"
+	  "           and exit\n");
+	fprintf(stderr, "  -m       Monitor MTD hotplug events and keep the card inventory\n"
+	  "           cache up to date\n");
+	fprintf(stderr, "  -U SOCK  Read uevents from Unix datagram socket SOCK instead of\n"
+	  "           netlink (testing)\n");
 	fprintf(stderr, "  -v       Show program version and exit\n");
+	fprintf(stderr, "  --stats[=json]\n"
+	  "           Print per-phase durations, bytes and MB/s to stderr\n");
+	fprintf(stderr, "  --mtd-stats\n"
+	  "           Print MTD operations latency histograms to stderr at exit\n");
+	fprintf(stderr, "  --progress=FD\n"
+	  "           Write the flash progress as newline-delimited JSON to FD\n");
+	fprintf(stderr, "  --calibrate\n"
+	  "           Measure the write/read throughput of different chunk sizes\n"
+	  "           while flashing and save the best ones (" TUNE_FILE ")\n");
+	fprintf(stderr, "  --rollback\n"
+	  "           Back up the partition to memory, flash only the changed\n"
+	  "           blocks, verify them and restore the backup on any error\n");
+	fprintf(stderr, "  --health\n"
+	  "           Show the recorded eraseblock erase/write times of card SN\n"
+	  "           (or all cards), their trend and outliers and exit\n");
+	fprintf(stderr, "  --selftest\n"
+	  "           Measure the card flash read throughput and per-block latency\n"
+	  "           and compare it with the card type baseline (" BASELINE_FILE ")\n");
+	fprintf(stderr, "  --selftest-blocks=FIRST-LAST\n"
+	  "           Also erase and rewrite (with their own content) blocks\n"
+	  "           FIRST to LAST to measure the erase/write throughput\n");
+	fprintf(stderr, "  --save-baseline\n"
+	  "           Save the self-test results as the card type baseline\n");
+	fprintf(stderr, "  --scan[=FIRST-LAST]\n"
+	  "           Torture the card flash blocks FIRST to LAST (all by default)\n"
+	  "           with test patterns, restore their content and show the\n"
+	  "           per-block results and times\n");
+	fprintf(stderr, "  --dump=FILE\n"
+	  "           Save the card FW partition to FILE as a FW image\n");
+	fprintf(stderr, "  --dump-version=VERSION\n"
+	  "           FW image header version of the dump (the card type is set\n"
+	  "           unless included), 0 by default\n");
+	fprintf(stderr, "  --dump-size=SIZE\n"
+	  "           Dump only the first SIZE bytes of the partition\n");
+	fprintf(stderr, "  --metrics[=MS]\n"
+	  "           Print the blocks/bytes flashed per card, the total throughput\n"
+	  "           and errors to stderr every MS milliseconds (default 1000)\n");
+	fprintf(stderr, "  --server=SOCK\n"
+	  "           Serve list/info/flash requests on Unix socket SOCK keeping\n"
+	  "           the card inventory up to date\n");
+	fprintf(stderr, "  --server-group=GROUP\n"
+	  "           Also allow the GROUP members to use the server socket\n"
+	  "           (only root and the server user by default)\n");
+	fprintf(stderr, "  --client=SOCK\n"
+	  "           Send the request to the fw-flash server on Unix socket SOCK\n");
 }
 
 int main(int argc, char *argv[])
 {
 	libmtd_t desc;
 	uint32_t sn = 0, version;
-	int opt, partition, info = 0;
-	const char *filename, *fw_type, *card_type;
+	int opt, info = 0, list = 0, use_cache = 0, mon = 0, health = 0,
+	  test = 0, metrics = 0, mtd_stats = 0, scan_first = -1, scan_last = -1;
+	unsigned metrics_ms = 1000;
+	struct selftest_opts st_opts = {.first = -1, .last = -1};
+	const char *filename, *uevent_path = NULL, *server_path = NULL,
+	  *client_path = NULL, *dump_path = NULL;
+	gid_t server_gid = (gid_t)-1;
+	uint32_t dump_version = 0, dump_size = 0;
+	char tune_path[PATH_MAX], health_path[PATH_MAX], baseline_path[PATH_MAX];
 	char *data;
 	size_t size;
-	struct list head;
-
-	while ((opt = getopt(argc, argv, "hils:v")) != -1) {
+	struct registry reg = REGISTRY_INIT;
+	struct card *card;
+	static const struct option long_options[] = {
+		{"stats", optional_argument, NULL, OPT_STATS},
+		{"mtd-stats", no_argument, NULL, OPT_MTD_STATS},
+		{"progress", required_argument, NULL, OPT_PROGRESS},
+		{"server", required_argument, NULL, OPT_SERVER},
+		{"server-group", required_argument, NULL, OPT_SERVER_GROUP},
+		{"client", required_argument, NULL, OPT_CLIENT},
+		{"calibrate", no_argument, NULL, OPT_CALIBRATE},
+		{"rollback", no_argument, NULL, OPT_ROLLBACK},
+		{"health", no_argument, NULL, OPT_HEALTH},
+		{"selftest", no_argument, NULL, OPT_SELFTEST},
+		{"selftest-blocks", required_argument, NULL, OPT_SELFTEST_BLOCKS},
+		{"save-baseline", no_argument, NULL, OPT_SAVE_BASELINE},
+		{"metrics", optional_argument, NULL, OPT_METRICS},
+		{"scan", optional_argument, NULL, OPT_SCAN},
+		{"dump", required_argument, NULL, OPT_DUMP},
+		{"dump-version", required_argument, NULL, OPT_DUMP_VERSION},
+		{"dump-size", required_argument, NULL, OPT_DUMP_SIZE},
+		{NULL, 0, NULL, 0}
+	};
+
+	while ((opt = getopt_long(argc, argv, "cE:hilmU:s:v", long_options,
+	  NULL)) != -1) {
 		switch (opt) {
+			case 'c':
+				use_cache = 1;
+				break;
+			case 'E':
+				emu_root = optarg;
+				break;
 			case 'h':
 				usage(argv[0]);
 				return EXIT_SUCCESS;
@@ -337,7 +451,14 @@ int main(int argc, char *argv[])
 				info = 1;
 				break;
 			case 'l':
-				return list_devices();
+				list = 1;
+				break;
+			case 'm':
+				mon = 1;
+				break;
+			case 'U':
+				uevent_path = optarg;
+				break;
 			case 's':
 				if (str2sn(optarg, &sn) < 0)
 					return EXIT_FAILURE;
@@ -345,11 +466,150 @@ int main(int argc, char *argv[])
 			case 'v':
 				printf("%s\n", VERSION);
 				return EXIT_SUCCESS;
+			case OPT_STATS:
+				if (!optarg)
+					stats_format = STATS_TEXT;
+				else if (!strcmp(optarg, "json"))
+					stats_format = STATS_JSON;
+				else {
+					fprintf(stderr, "%s: invalid stats format\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_MTD_STATS:
+				mtd_stats = 1;
+				break;
+			case OPT_PROGRESS:
+				if (str2fd(optarg, &flash_opts.progress_fd) < 0)
+					return EXIT_FAILURE;
+				/* A closed progress reader must not kill the flashing */
+				signal(SIGPIPE, SIG_IGN);
+				break;
+			case OPT_SERVER:
+				server_path = optarg;
+				break;
+			case OPT_SERVER_GROUP:
+				if (str2gid(optarg, &server_gid) < 0)
+					return EXIT_FAILURE;
+				break;
+			case OPT_CLIENT:
+				client_path = optarg;
+				break;
+			case OPT_CALIBRATE:
+				flash_opts.calibrate = 1;
+				break;
+			case OPT_ROLLBACK:
+				flash_opts.rollback = 1;
+				break;
+			case OPT_HEALTH:
+				health = 1;
+				break;
+			case OPT_SELFTEST:
+				test = 1;
+				break;
+			case OPT_SELFTEST_BLOCKS:
+				if (sscanf(optarg, "%d-%d", &st_opts.first, &st_opts.last) != 2
+				  || st_opts.first < 0) {
+					fprintf(stderr, "%s: invalid block range\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
+			case OPT_SAVE_BASELINE:
+				st_opts.save = 1;
+				break;
+			case OPT_METRICS:
+				if (optarg && str2ms(optarg, &metrics_ms) < 0)
+					return EXIT_FAILURE;
+				metrics = 1;
+				break;
+			case OPT_DUMP:
+				dump_path = optarg;
+				break;
+			case OPT_DUMP_VERSION:
+				if (str2u32(optarg, "version", &dump_version) < 0)
+					return EXIT_FAILURE;
+				break;
+			case OPT_DUMP_SIZE:
+				if (str2u32(optarg, "size", &dump_size) < 0)
+					return EXIT_FAILURE;
+				break;
+			case OPT_SCAN:
+				scan_first = 0;
+				if (optarg && (sscanf(optarg, "%d-%d", &scan_first,
+				  &scan_last) != 2 || scan_first < 0)) {
+					fprintf(stderr, "%s: invalid block range\n", optarg);
+					return EXIT_FAILURE;
+				}
+				break;
 			default: /* '?' */
 				usage(argv[0]);
 				return EXIT_FAILURE;
 		}
 	}
+	if (flash_opts.calibrate && flash_opts.rollback) {
+		fprintf(stderr, "--calibrate and --rollback are exclusive\n");
+		return EXIT_FAILURE;
+	}
+	/* The server takes the flash options per request (--client) */
+	if (server_path && flash_opts.rollback) {
+		fprintf(stderr, "--server and --rollback are exclusive\n");
+		return EXIT_FAILURE;
+	}
+	/* The server does the work, the local options would be ignored */
+	if (client_path && (emu_root || use_cache || mon || uevent_path
+	  || server_path || stats_format != STATS_NONE || mtd_stats || metrics
+	  || flash_opts.calibrate || health || test || dump_path
+	  || scan_first >= 0)) {
+		fprintf(stderr, "--client only takes -l, -i, -s, --progress and "
+		  "--rollback\n");
+		return EXIT_FAILURE;
+	}
+	if (mtd_stats) {
+		mtd_stats_enable(1);
+		atexit(mtd_stats_print);
+	}
+
+	if (emu_root) {
+		/* Keep the emulator calibration and health apart from the cards */
+		snprintf(tune_path, sizeof(tune_path), "%s/tune", emu_root);
+		tune_file = tune_path;
+		snprintf(health_path, sizeof(health_path), "%s/health", emu_root);
+		health_dir = health_path;
+		snprintf(baseline_path, sizeof(baseline_path), "%s/baseline",
+		  emu_root);
+		baseline_file = baseline_path;
+	}
+
+	if (metrics) {
+		if (metrics_start(stderr, metrics_ms) < 0) {
+			fprintf(stderr, "Error starting metrics reporter: %s\n",
+			  strerror(errno));
+			return EXIT_FAILURE;
+		}
+		atexit(metrics_stop);
+	}
+
+	if (health)
+		return health_report(stdout, sn) < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+	if (test)
+		return selftest_card(use_cache, sn, &st_opts)
+		  ? EXIT_FAILURE : EXIT_SUCCESS;
+	if (dump_path)
+		return dump_card(use_cache, sn, dump_version, dump_size, dump_path)
+		  ? EXIT_FAILURE : EXIT_SUCCESS;
+	if (scan_first >= 0)
+		return scan_card(use_cache, sn, scan_first, scan_last)
+		  ? EXIT_FAILURE : EXIT_SUCCESS;
+	if (server_path)
+		return serve(server_path, uevent_path, server_gid) < 0
+		  ? EXIT_FAILURE : EXIT_SUCCESS;
+	if (client_path && list)
+		return request(client_path, list, info, sn, NULL) < 0
+		  ? EXIT_FAILURE : EXIT_SUCCESS;
+	if (list)
+		return list_devices(use_cache);
+	if (mon)
+		return monitor_devices(uevent_path);
 
 	if (optind >= argc) {
 		usage(argv[0]);
@@ -357,52 +617,39 @@ int main(int argc, char *argv[])
 	} else
 		filename = argv[optind];
 
+	if (client_path)
+		return request(client_path, list, info, sn, filename) < 0
+		  ? EXIT_FAILURE : EXIT_SUCCESS;
+
 	if (read_fw(filename, &data, &size, &version) < 0)
 		return EXIT_FAILURE;
 	if (info) {
-		switch (version >> 24) {
-			case 1:
-				fw_type = "FPDL3";
-				break;
-			case 2:
-				fw_type = "GMSL3";
-				break;
-			case 3:
-				fw_type = "GMSL1";
-				break;
-			case 4:
-				fw_type = "FPDL4";
-				break;
-			default:
-				fw_type = "UNKNOWN";
-		}
-		card_type = (((version >> 16) & 0xff) == 1)
-		  ? "T100" : (((version >> 16) & 0xff) == 2) ? "T200" : "UNKNOWN";
-		printf("card: %s\ntype: %s\nversion: %u\nsize: %zu\n",
-		  card_type, fw_type, version & 0xFFFF, size);
+		fw_info(stdout, version, size);
+		fflush(stdout);
+		stats_print(stderr);
+		free(data);
 		return EXIT_SUCCESS;
 	}
 
-	LIST_INIT(&head);
-
 	if (!(desc = mtd_open()))
 		goto error_data;
-	if (part_list(desc, &head) < 0)
-		goto error_mtd;
-	if ((partition = part_find(&head, sn, ((version >> 16) & 0xff))) < 0)
+	if (card_list(desc, &reg, use_cache) < 0)
 		goto error_list;
-	if (flash_fw(desc, partition, data, size) < 0)
+	if (!(card = part_find(&reg, sn, ((version >> 16) & 0xff))))
+		goto error_list;
+	stats_card(card->sn, card->fw_num);
+	if (flash_fw(desc, card->fw_num, card->sn, data, size, &flash_opts) < 0)
 		goto error_list;
 
-	free_list(&head);
+	stats_print(stderr);
+	registry_free(&reg);
 	free(data);
 	libmtd_close(desc);
 
 	return EXIT_SUCCESS;
 
 error_list:
-	free_list(&head);
-error_mtd:
+	registry_free(&reg);
 	libmtd_close(desc);
 error_data:
 	free(data);
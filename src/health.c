@@ -0,0 +1,278 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <dirent.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "card.h"
+#include "stats.h"
+#include "tune.h"
+#include "health.h"
+
+
+/* Erase time of a block compared to the median of the flash */
+#define HEALTH_OUTLIER 2.0
+/* Erase time of a block compared to its mean over the previous flashes */
+#define HEALTH_SLOWING 1.5
+
+struct row {
+	long long time;
+	int num;
+	int block;
+	uint32_t erase_us;
+	uint32_t write_us;
+};
+
+struct flash {
+	int start;
+	int cnt;
+};
+
+const char *health_dir = HEALTH_DIR;
+
+int health_init(struct health *h, int num, int blocks)
+{
+	h->time = time(NULL);
+	h->num = num;
+	h->blocks = blocks;
+	h->erase_us = calloc(blocks, sizeof(*h->erase_us));
+	h->write_us = calloc(blocks, sizeof(*h->write_us));
+	if (!h->erase_us || !h->write_us) {
+		health_free(h);
+		return -1;
+	}
+
+	return 0;
+}
+
+void health_free(struct health *h)
+{
+	free(h->erase_us);
+	free(h->write_us);
+	h->erase_us = NULL;
+	h->write_us = NULL;
+}
+
+int health_store(const char *dir, uint32_t sn, const struct health *h)
+{
+	char path[PATH_MAX], sns[16];
+	struct stat st;
+	FILE *fp;
+	int i;
+
+	if (!h->erase_us)
+		return -1;
+
+	sn2str(sn, sns, sizeof(sns));
+	if (snprintf(path, sizeof(path), "%s/%s.csv", dir, sns)
+	  >= sizeof(path)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	if (mkparent(path) < 0)
+		return -1;
+
+	if (!(fp = fopen(path, "a")))
+		return -1;
+	if (fstat(fileno(fp), &st) == 0 && !st.st_size)
+		fprintf(fp, "# time,mtd,block,erase_us,write_us\n");
+	for (i = 0; i < h->blocks; i++)
+		if (h->erase_us[i])
+			fprintf(fp, "%lld,%d,%d,%u,%u\n", (long long)h->time, h->num, i,
+			  h->erase_us[i], h->write_us[i]);
+
+	return fclose(fp) ? -1 : 0;
+}
+
+static int load(const char *path, struct row **rows, int *cnt)
+{
+	struct row r, *tmp;
+	char line[128];
+	int size = 0;
+	FILE *fp;
+
+	*rows = NULL;
+	*cnt = 0;
+
+	if (!(fp = fopen(path, "r")))
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%lld,%d,%d,%u,%u", &r.time, &r.num, &r.block,
+		  &r.erase_us, &r.write_us) != 5 || r.block < 0)
+			continue;
+		if (*cnt == size) {
+			size = size ? size * 2 : 256;
+			if (!(tmp = realloc(*rows, size * sizeof(**rows)))) {
+				fclose(fp);
+				free(*rows);
+				return -1;
+			}
+			*rows = tmp;
+		}
+		(*rows)[(*cnt)++] = r;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+static void print_flash(FILE *fp, const struct row *rows, const struct flash *f,
+  uint32_t *buf, uint32_t *erase_p50)
+{
+	char date[32];
+	time_t t = rows[f->start].time;
+	uint32_t *w = buf + f->cnt;
+	int i;
+
+	for (i = 0; i < f->cnt; i++) {
+		buf[i] = rows[f->start + i].erase_us;
+		w[i] = rows[f->start + i].write_us;
+	}
+	stats_sort(buf, f->cnt);
+	stats_sort(w, f->cnt);
+
+	strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	fprintf(fp, "%-19s %5d %7d %10.2f %10.2f %10.2f %10.2f %10.2f\n", date,
+	  rows[f->start].num, f->cnt, stats_pct(buf, f->cnt, 50) / 1e3,
+	  stats_pct(buf, f->cnt, 99) / 1e3, buf[f->cnt - 1] / 1e3,
+	  stats_pct(w, f->cnt, 50) / 1e3, w[f->cnt - 1] / 1e3);
+
+	*erase_p50 = stats_pct(buf, f->cnt, 50);
+}
+
+static int report_card(FILE *fp, const char *path, const char *sn)
+{
+	struct row *rows;
+	struct flash *flashes = NULL, *last;
+	uint32_t *buf = NULL, p50 = 0, first_p50 = 0;
+	double *sum = NULL, mean;
+	int *n = NULL;
+	int i, cnt, fcnt = 0, blocks = 0, max = 0;
+
+	if (load(path, &rows, &cnt) < 0) {
+		if (errno == ENOENT)
+			fprintf(stderr, "%s: no health records\n", sn);
+		else
+			fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	if (!cnt) {
+		free(rows);
+		return 0;
+	}
+
+	/* The eraseblocks of a single flash are stored in consecutive lines */
+	if (!(flashes = malloc(cnt * sizeof(*flashes))))
+		goto error;
+	for (i = 0; i < cnt; i++) {
+		if (!i || rows[i].time != rows[i - 1].time
+		  || rows[i].num != rows[i - 1].num
+		  || rows[i].block <= rows[i - 1].block) {
+			flashes[fcnt].start = i;
+			flashes[fcnt++].cnt = 0;
+		}
+		flashes[fcnt - 1].cnt++;
+		if (flashes[fcnt - 1].cnt > max)
+			max = flashes[fcnt - 1].cnt;
+		if (rows[i].block >= blocks)
+			blocks = rows[i].block + 1;
+	}
+	if (!(buf = malloc(2 * max * sizeof(*buf))))
+		goto error;
+
+	fprintf(fp, "card %s (times in ms)\n", sn);
+	fprintf(fp, "%-19s %5s %7s %10s %10s %10s %10s %10s\n", "date", "mtd",
+	  "blocks", "erase p50", "erase p99", "erase max", "write p50",
+	  "write max");
+	for (i = 0; i < fcnt; i++) {
+		print_flash(fp, rows, &flashes[i], buf, &p50);
+		if (!i)
+			first_p50 = p50;
+	}
+	if (fcnt > 1 && first_p50)
+		fprintf(fp, "erase p50 trend: %+.1f%% over %d flashes\n",
+		  (p50 - (double)first_p50) * 100.0 / first_p50, fcnt);
+
+	last = &flashes[fcnt - 1];
+	for (i = last->start; i < last->start + last->cnt; i++)
+		if (p50 && rows[i].erase_us > HEALTH_OUTLIER * p50)
+			fprintf(fp, "outlier: block %d erase %.2f ms (%.1fx p50)\n",
+			  rows[i].block, rows[i].erase_us / 1e3,
+			  (double)rows[i].erase_us / p50);
+
+	/* Compare the last flash with the mean of the previous ones per block */
+	if (!(sum = calloc(blocks, sizeof(*sum))) || !(n = calloc(blocks,
+	  sizeof(*n))))
+		goto error;
+	for (i = 0; i < last->start; i++) {
+		sum[rows[i].block] += rows[i].erase_us;
+		n[rows[i].block]++;
+	}
+	for (i = last->start; i < last->start + last->cnt; i++) {
+		if (!n[rows[i].block])
+			continue;
+		mean = sum[rows[i].block] / n[rows[i].block];
+		if (mean > 0 && rows[i].erase_us > HEALTH_SLOWING * mean)
+			fprintf(fp, "slowing: block %d erase %.2f ms (%.1fx mean of %d "
+			  "flashes)\n", rows[i].block, rows[i].erase_us / 1e3,
+			  rows[i].erase_us / mean, n[rows[i].block]);
+	}
+
+	free(n);
+	free(sum);
+	free(buf);
+	free(flashes);
+	free(rows);
+
+	return 0;
+
+error:
+	fprintf(stderr, "Error allocating health report memory\n");
+	free(n);
+	free(sum);
+	free(buf);
+	free(flashes);
+	free(rows);
+
+	return -1;
+}
+
+static int csv_filter(const struct dirent *de)
+{
+	size_t len = strlen(de->d_name);
+
+	return len > 4 && !strcmp(de->d_name + len - 4, ".csv");
+}
+
+int health_report(FILE *fp, uint32_t sn)
+{
+	char path[PATH_MAX], sns[16];
+	struct dirent **list;
+	int i, cnt, ret = 0;
+
+	if (sn) {
+		sn2str(sn, sns, sizeof(sns));
+		snprintf(path, sizeof(path), "%s/%s.csv", health_dir, sns);
+		return report_card(fp, path, sns);
+	}
+
+	if ((cnt = scandir(health_dir, &list, csv_filter, alphasort)) < 0) {
+		fprintf(stderr, "%s: %s\n", health_dir, strerror(errno));
+		return -1;
+	}
+	for (i = 0; i < cnt; i++) {
+		snprintf(path, sizeof(path), "%s/%s", health_dir, list[i]->d_name);
+		list[i]->d_name[strlen(list[i]->d_name) - 4] = '\0';
+		if (i)
+			fprintf(fp, "\n");
+		if (report_card(fp, path, list[i]->d_name) < 0)
+			ret = -1;
+		free(list[i]);
+	}
+	free(list);
+
+	return ret;
+}
@@ -0,0 +1,38 @@
+#ifndef HEALTH_H
+#define HEALTH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#define HEALTH_DIR "/var/lib/fw-flash/health"
+
+/*
+ * Per-eraseblock erase and write (program) times of a single flash. The times
+ * of all the flashes of a card are appended to DIR/SN.csv (HEALTH_DIR, or
+ * health_dir by default) as
+ * "time,mtd,block,erase_us,write_us" lines. Rising erase times are the first
+ * sign of a worn flash.
+ */
+struct health {
+	time_t time;
+	int num;
+	int blocks;
+	uint32_t *erase_us;
+	uint32_t *write_us;
+};
+
+extern const char *health_dir;
+
+extern int health_init(struct health *h, int num, int blocks);
+extern void health_free(struct health *h);
+extern int health_store(const char *dir, uint32_t sn,
+  const struct health *h);
+
+/*
+ * Prints the per-flash erase/write time statistics, the erase time trend and
+ * the outlier eraseblocks of card sn, or of all the recorded cards if sn is 0.
+ */
+extern int health_report(FILE *fp, uint32_t sn);
+
+#endif /* HEALTH_H */
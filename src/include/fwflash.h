@@ -0,0 +1,109 @@
+/*
+ * mgb4 firmware flashing library.
+ *
+ * The library flashes FW images held in memory to the FG4 cards found on the
+ * system MTD devices (or the MTD emulator), reporting the progress through a
+ * callback. A handle keeps the MTD library open and the card inventory
+ * loaded, so repeated flashing does not repeat the initialization.
+ *
+ * The functions return -1 on error and print the reason to stderr. A handle
+ * must not be used from multiple threads at the same time.
+ */
+
+#ifndef FWFLASH_H
+#define FWFLASH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define FWFLASH_API __attribute__((visibility("default")))
+
+typedef struct fwflash fwflash_t;
+
+struct fwflash_card {
+	uint32_t sn;
+	int type;	/* 1 = T100, 2 = T200 */
+	int mtd_num;	/* FW partition MTD device number */
+};
+
+/* A validated FW image, data points into the buffer passed to fwflash_image() */
+struct fwflash_image {
+	const void *data;
+	size_t size;
+	uint32_t version;
+};
+
+enum fwflash_phase {
+	FWFLASH_ERASE,
+	FWFLASH_WRITE,
+	FWFLASH_VERIFY,
+	FWFLASH_DONE
+};
+
+/*
+ * Flash progress of a card. The callback is called at most every 100ms per
+ * phase plus once at the end of each phase and once with FWFLASH_DONE and the
+ * flashing result.
+ */
+struct fwflash_progress {
+	uint32_t sn;
+	int mtd_num;
+	enum fwflash_phase phase;
+	int blocks;
+	int blocks_total;
+	uint64_t bytes;
+	uint64_t bytes_total;
+	double mbps;
+	double avg_mbps;
+	double eta_s;
+	double elapsed_s;
+	int result;
+};
+
+typedef void (*fwflash_progress_cb)(const struct fwflash_progress *p,
+  void *arg);
+
+/*
+ * Opens the MTD devices (or the MTD emulator tree emu_root if not NULL, see
+ * scripts/make-emu.sh) and loads the card inventory.
+ */
+FWFLASH_API fwflash_t *fwflash_open(const char *emu_root);
+FWFLASH_API void fwflash_close(fwflash_t *fw);
+
+/* Reloads the card inventory, e.g. after a card was added or removed */
+FWFLASH_API int fwflash_scan(fwflash_t *fw);
+
+/*
+ * Stores up to max cards of the inventory (sorted by SN) to cards and returns
+ * the number of cards present.
+ */
+FWFLASH_API int fwflash_cards(fwflash_t *fw, struct fwflash_card *cards,
+  int max);
+
+/* Validates the FW image (header, size and CRC) in buf without copying it */
+FWFLASH_API int fwflash_image(const void *buf, size_t len,
+  struct fwflash_image *img);
+
+/*
+ * With rollback enabled, fwflash_flash() backs up the card partition to memory,
+ * erases and writes only the eraseblocks that change, verifies them
+ * (FWFLASH_VERIFY) and restores the backup if the flashing fails.
+ */
+FWFLASH_API void fwflash_set_rollback(fwflash_t *fw, int enable);
+
+/*
+ * Flashes the image to the card with serial number sn (or to the only card
+ * present if sn is 0). The card type must match the image. cb may be NULL.
+ */
+FWFLASH_API int fwflash_flash(fwflash_t *fw, uint32_t sn,
+  const struct fwflash_image *img, fwflash_progress_cb cb, void *arg);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FWFLASH_H */
@@ -23,7 +23,10 @@
 #ifndef __LIBMTD_H__
 #define __LIBMTD_H__
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -34,6 +37,11 @@ extern "C" {
 /* Maximum MTD device type string length */
 #define MTD_TYPE_MAX 64
 
+/* Number of the latency histogram buckets */
+#define MTD_HIST_BUCKETS 32
+/* Number of MTD devices (lowest numbers) the statistics are collected for */
+#define MTD_STATS_DEVS 64
+
 /* MTD library descriptor */
 typedef void * libmtd_t;
 
@@ -93,6 +101,38 @@ struct mtd_dev_info
 	unsigned int bb_allowed:1;
 };
 
+/**
+ * enum mtd_op - MTD operation types with collected statistics.
+ * @MTD_OP_ERASE: eraseblocks erase (%MEMERASE64 or %MEMERASE ioctl)
+ * @MTD_OP_WRITE: 'mtd_write()', 'mtd_write_multi()' and 'mtd_writev()'
+ * @MTD_OP_READ: 'mtd_read()', 'mtd_read_multi()' and 'mtd_readv()'
+ * @MTD_OP_SYSFS: MTD device sysfs attribute read
+ */
+enum mtd_op
+{
+	MTD_OP_ERASE,
+	MTD_OP_WRITE,
+	MTD_OP_READ,
+	MTD_OP_SYSFS,
+	MTD_OP_CNT
+};
+
+/**
+ * struct mtd_op_stats - MTD operation latency statistics.
+ * @count: number of operations
+ * @total_us: total time of all the operations in microseconds
+ * @max_us: the longest operation time in microseconds
+ * @hist: latency histogram, bucket 0 counts operations faster than 2us,
+ *        bucket N > 0 operations taking [2^N, 2^(N+1)) microseconds
+ */
+struct mtd_op_stats
+{
+	uint64_t count;
+	uint64_t total_us;
+	uint64_t max_us;
+	uint64_t hist[MTD_HIST_BUCKETS];
+};
+
 /**
  * libmtd_open - open MTD library.
  *
@@ -100,15 +140,68 @@ struct mtd_dev_info
  * descriptor in case of success and %NULL in case of failure. In case of
  * failure, errno contains zero if MTD is not present in the system, or
  * contains the error code if a real error happened.
+ *
+ * The descriptor is the only heap allocation made by the library. The query
+ * functions ('mtd_get_info()', 'mtd_get_dev_info1()', ...) and the data path
+ * functions ('mtd_read()', 'mtd_write()', 'mtd_erase()', ...) do not allocate
+ * memory.
+ *
+ * The MTD capabilities (sysfs support, 64-bit offset ioctls) are probed here
+ * once and the descriptor is never modified afterwards, so a descriptor may be
+ * used by any number of threads concurrently. The data path functions use
+ * positional I/O and never move the file offset, so an MTD device file
+ * descriptor may be shared by threads too, as long as they access different
+ * parts of the device.
  */
 libmtd_t libmtd_open(void);
 
+/**
+ * libmtd_open_emu - open MTD library on an emulated MTD tree.
+ * @root: emulator root directory
+ *
+ * This function is similar to 'libmtd_open()', but instead of the system MTD
+ * devices it uses an emulated tree in the @root directory: a fake sysfs tree
+ * in @root/sys/class/mtd, the device "nodes" as regular files @root/dev/mtdN
+ * and the emulator timing model in @root/emu.conf. Erase fills the regular
+ * files with 0xFF bytes, writes may only clear bits and all operations are
+ * delayed according to the timing model.
+ *
+ * The emulator is process-wide. It is enabled while any emulator descriptor
+ * is open and disabled again by the last 'libmtd_close()'. Emulated and real
+ * MTD devices can not be used at the same time, this function fails with
+ * %EBUSY while a 'libmtd_open()' descriptor is open and vice versa, and also
+ * if the emulator is open with a different timing model.
+ */
+libmtd_t libmtd_open_emu(const char *root);
+
 /**
  * libmtd_close - close MTD library.
  * @desc: MTD library descriptor
  */
 void libmtd_close(libmtd_t desc);
 
+/**
+ * libmtd_set_quiet - suppress the library error messages.
+ * @quiet: non-zero to stop printing the error and warning messages to stderr
+ *
+ * The library functions print the reason of a failure to stderr in addition
+ * to returning %-1 and setting errno. Programs that report the errors
+ * themselves (e.g. the C++ wrapper in libmtd.hpp) can turn the messages off.
+ * The setting is process-wide.
+ */
+void libmtd_set_quiet(int quiet);
+
+/**
+ * mtd_dev_node - get MTD device node path.
+ * @desc: MTD library descriptor
+ * @mtd_num: MTD device number
+ * @buf: the device node path is returned here
+ * @size: size of @buf
+ *
+ * This function returns %0 in case of success and %-1 in case of failure.
+ */
+int mtd_dev_node(libmtd_t desc, int mtd_num, char *buf, size_t size);
+
 /**
  * mtd_dev_present - check whether a MTD device is present.
  * @desc: MTD library descriptor
@@ -152,6 +245,22 @@ int mtd_get_dev_info(libmtd_t desc, const char *node, struct mtd_dev_info *mtd);
  */
 int mtd_get_dev_info1(libmtd_t desc, int mtd_num, struct mtd_dev_info *mtd);
 
+/**
+ * mtd_get_dev_stamp - get identity stamp of an MTD device.
+ * @desc: MTD library descriptor
+ * @mtd_num: MTD device number
+ * @major: major number of corresponding character device is returned here
+ * @minor: minor number of corresponding character device is returned here
+ * @ino: inode number of the MTD device sysfs entry is returned here
+ *
+ * This function returns cheap-to-get information identifying the MTD device
+ * instance without touching the flash. The stamp changes whenever the device
+ * is removed and created again. Returns %0 in case of success and %-1 in case
+ * of failure. If MTD sysfs is not supported, errno is set to %EOPNOTSUPP.
+ */
+int mtd_get_dev_stamp(libmtd_t desc, int mtd_num, int *major, int *minor,
+		      unsigned long long *ino);
+
 /**
  * mtd_lock - lock eraseblocks.
  * @desc: MTD library descriptor
@@ -229,6 +338,17 @@ int mtd_regioninfo(int fd, int regidx, struct region_info_user *reginfo);
  */
 int mtd_is_locked(const struct mtd_dev_info *mtd, int fd, int eb);
 
+/**
+ * mtd_check_pattern - check if buffer contains only a certain byte pattern.
+ * @buf: buffer to check
+ * @patt: the pattern to check
+ * @size: buffer size in bytes
+ *
+ * The buffer is compared in 32-byte vectors. Returns %-1 if all the bytes of
+ * @buf are @patt and the offset of the first other byte otherwise.
+ */
+int mtd_check_pattern(const void *buf, uint8_t patt, int size);
+
 /**
  * mtd_torture - torture an eraseblock.
  * @desc: MTD library descriptor
@@ -241,6 +361,20 @@ int mtd_is_locked(const struct mtd_dev_info *mtd, int fd, int eb);
  */
 int mtd_torture(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb);
 
+/**
+ * mtd_torture_buf - torture an eraseblock using a caller-supplied buffer.
+ * @desc: MTD library descriptor
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @eb: eraseblock to torture
+ * @buf: scratch buffer of at least @mtd->eb_size bytes
+ *
+ * This function is identical to 'mtd_torture()' except that it does not
+ * allocate any memory.
+ */
+int mtd_torture_buf(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+		    int eb, void *buf);
+
 /**
  * mtd_is_bad - check if eraseblock is bad.
  * @mtd: MTD device description object
@@ -302,6 +436,77 @@ int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
 	      int offs, void *data, int len, void *oob, int ooblen,
 	      uint8_t mode);
 
+/**
+ * mtd_read_multi - read data spanning multiple eraseblocks.
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @eb: eraseblock to start reading from
+ * @offs: offset withing the eraseblock to start reading from
+ * @buf: buffer to read data to
+ * @len: how many bytes to read
+ *
+ * This function is similar to 'mtd_read()', but the read may cross
+ * eraseblock boundaries (up to the end of the device) and is done with as few
+ * 'pread()' calls as possible. Returns %0 in case of success and %-1 in case of
+ * failure.
+ */
+int mtd_read_multi(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+		   void *buf, int len);
+
+/**
+ * mtd_write_multi - write data spanning multiple eraseblocks.
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @eb: eraseblock to start writing to
+ * @offs: offset withing the eraseblock to start writing to
+ * @data: data buffer to write
+ * @len: how many data bytes to write
+ *
+ * This function is similar to 'mtd_write()' without OOB data, but the write
+ * may cross eraseblock boundaries (up to the end of the device) and is passed
+ * to the MTD driver in as few 'pwrite()' calls as possible. @offs and @len must
+ * be aligned to the min. I/O unit size. Returns %0 in case of success and %-1
+ * in case of failure.
+ */
+int mtd_write_multi(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+		    const void *data, int len);
+
+/**
+ * mtd_readv - read data spanning multiple eraseblocks to multiple buffers.
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @eb: eraseblock to start reading from
+ * @offs: offset withing the eraseblock to start reading from
+ * @iov: buffers to read data to
+ * @iovcnt: count of @iov buffers
+ *
+ * This function is similar to 'mtd_read_multi()', but the contiguous data
+ * are scattered to the @iov buffers in a single 'preadv()' call, e.g. to read
+ * multiple eraseblocks to separate buffers. The total length of the buffers
+ * must not exceed %INT_MAX. Returns %0 in case of success and %-1 in case of
+ * failure.
+ */
+int mtd_readv(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	      const struct iovec *iov, int iovcnt);
+
+/**
+ * mtd_writev - write data from multiple buffers spanning multiple eraseblocks.
+ * @mtd: MTD device description object
+ * @fd: MTD device node file descriptor
+ * @eb: eraseblock to start writing to
+ * @offs: offset withing the eraseblock to start writing to
+ * @iov: data buffers to write
+ * @iovcnt: count of @iov buffers
+ *
+ * This function is similar to 'mtd_write_multi()', but the data are gathered
+ * from the @iov buffers in a single 'pwritev()' call. The MTD driver writes the
+ * buffers one by one, so @offs and the length of every buffer must be aligned
+ * to the min. I/O unit size. Returns %0 in case of success and %-1 in case of
+ * failure.
+ */
+int mtd_writev(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	       const struct iovec *iov, int iovcnt);
+
 /**
  * mtd_read_oob - read out-of-band area.
  * @desc: MTD library descriptor
@@ -347,6 +552,36 @@ int mtd_write_oob(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
  */
 int mtd_probe_node(libmtd_t desc, const char *node);
 
+/**
+ * mtd_stats_enable - enable or disable MTD operation statistics.
+ * @enable: non-zero to enable the statistics collection
+ *
+ * Statistics are collected process-wide for MTD devices 0 to
+ * %MTD_STATS_DEVS - 1. When disabled (the default), the collection costs one
+ * branch per operation.
+ */
+void mtd_stats_enable(int enable);
+
+/**
+ * mtd_stats_get - get MTD operation statistics.
+ * @mtd_num: MTD device number
+ * @op: operation type
+ * @stats: the statistics are returned here
+ *
+ * This function returns %0 in case of success and %-1 in case of failure
+ * (@mtd_num or @op out of range, errno is set to %EINVAL).
+ */
+int mtd_stats_get(int mtd_num, enum mtd_op op, struct mtd_op_stats *stats);
+
+/**
+ * mtd_stats_dump - print MTD operation statistics.
+ * @fp: the stream to print the statistics to
+ *
+ * This function prints a summary and the latency histogram of all the MTD
+ * devices and operation types with non-zero operation count.
+ */
+void mtd_stats_dump(FILE *fp);
+
 #ifdef __cplusplus
 }
 #endif
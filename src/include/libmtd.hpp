@@ -0,0 +1,286 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * Header-only C++20 wrapper of the MTD library.
+ *
+ * The wrapper owns the library descriptor and the MTD device file descriptors
+ * (RAII, move-only) and reports the errors as result values carrying an
+ * std::error_code instead of printing them. The data path methods take
+ * std::span views of the caller buffers and pass them directly to
+ * 'mtd_read_multi()'/'mtd_write_multi()', no data is copied or allocated.
+ *
+ *	auto lib = mtd::Library::open();
+ *	if (!lib)
+ *		return lib.error();
+ *	auto dev = lib->open_device(0);
+ *	if (!dev)
+ *		return dev.error();
+ *	if (auto r = dev->erase(0, 1); !r)
+ *		return r.error();
+ *	if (auto r = dev->write(0, 0, std::as_bytes(std::span(data))); !r)
+ *		return r.error();
+ *
+ * A Device must not outlive the Library it was opened from. Like the C
+ * library descriptor, a Library may be shared by any number of threads. The
+ * data path uses positional I/O, so a Device may be used from multiple threads
+ * too as long as they access different eraseblocks.
+ */
+
+#ifndef __LIBMTD_HPP__
+#define __LIBMTD_HPP__
+
+#include <cerrno>
+#include <climits>
+#include <cstddef>
+#include <span>
+#include <system_error>
+#include <utility>
+#include <variant>
+#include <fcntl.h>
+#include <unistd.h>
+#include "libmtd.h"
+
+namespace mtd {
+
+/* The error of the last failed C library call */
+inline std::error_code last_error()
+{
+	/* libmtd_open() sets errno to zero when there is no MTD subsystem */
+	return std::error_code(errno ? errno : ENODEV, std::generic_category());
+}
+
+/**
+ * Result - value of type T or the error of the operation.
+ */
+template <typename T>
+class [[nodiscard]] Result {
+public:
+	Result(T &&value) : v_(std::move(value)) {}
+	Result(const T &value) : v_(value) {}
+	Result(std::error_code ec) : v_(ec) {}
+
+	explicit operator bool() const noexcept { return v_.index() == 0; }
+	bool ok() const noexcept { return v_.index() == 0; }
+
+	T &value() & { return std::get<0>(v_); }
+	const T &value() const & { return std::get<0>(v_); }
+	T &&value() && { return std::get<0>(std::move(v_)); }
+	T &operator*() & { return value(); }
+	const T &operator*() const & { return value(); }
+	T &&operator*() && { return std::move(*this).value(); }
+	T *operator->() { return &value(); }
+	const T *operator->() const { return &value(); }
+
+	std::error_code error() const noexcept
+	{
+		return ok() ? std::error_code() : std::get<1>(v_);
+	}
+
+private:
+	std::variant<T, std::error_code> v_;
+};
+
+template <>
+class [[nodiscard]] Result<void> {
+public:
+	Result() = default;
+	Result(std::error_code ec) : ec_(ec) {}
+
+	explicit operator bool() const noexcept { return !ec_; }
+	bool ok() const noexcept { return !ec_; }
+	std::error_code error() const noexcept { return ec_; }
+
+private:
+	std::error_code ec_;
+};
+
+/**
+ * Fd - move-only file descriptor owner.
+ */
+class Fd {
+public:
+	Fd() noexcept = default;
+	explicit Fd(int fd) noexcept : fd_(fd) {}
+	Fd(Fd &&other) noexcept : fd_(other.release()) {}
+	Fd &operator=(Fd &&other) noexcept
+	{
+		if (this != &other)
+			reset(other.release());
+		return *this;
+	}
+	Fd(const Fd &) = delete;
+	Fd &operator=(const Fd &) = delete;
+	~Fd() { reset(); }
+
+	int get() const noexcept { return fd_; }
+	explicit operator bool() const noexcept { return fd_ >= 0; }
+
+	int release() noexcept { return std::exchange(fd_, -1); }
+	void reset(int fd = -1) noexcept
+	{
+		if (fd_ >= 0)
+			::close(fd_);
+		fd_ = fd;
+	}
+
+private:
+	int fd_ = -1;
+};
+
+class Library;
+
+/**
+ * Device - an open MTD device.
+ *
+ * Erase, read and write address the device by eraseblock @eb and offset @offs
+ * within it. Reads and writes may cross eraseblock boundaries up to the end of
+ * the device, writes must target erased flash.
+ */
+class Device {
+public:
+	Device(Device &&) noexcept = default;
+	Device(const Device &) = delete;
+	Device &operator=(const Device &) = delete;
+
+	const mtd_dev_info &info() const noexcept { return info_; }
+	int fd() const noexcept { return fd_.get(); }
+
+	Result<void> erase(int eb, int blocks = 1)
+	{
+		if (mtd_erase_multi(desc_, &info_, fd_.get(), eb, blocks))
+			return last_error();
+		return {};
+	}
+
+	Result<void> read(int eb, int offs, std::span<std::byte> buf)
+	{
+		if (buf.size() > INT_MAX)
+			return std::make_error_code(std::errc::invalid_argument);
+		if (mtd_read_multi(&info_, fd_.get(), eb, offs, buf.data(),
+		    static_cast<int>(buf.size())))
+			return last_error();
+		return {};
+	}
+
+	Result<void> write(int eb, int offs, std::span<const std::byte> data)
+	{
+		if (data.size() > INT_MAX)
+			return std::make_error_code(std::errc::invalid_argument);
+		if (mtd_write_multi(&info_, fd_.get(), eb, offs, data.data(),
+		    static_cast<int>(data.size())))
+			return last_error();
+		return {};
+	}
+
+private:
+	friend class Library;
+
+	Device(libmtd_t desc, const mtd_dev_info &info, Fd fd) noexcept
+	  : desc_(desc), info_(info), fd_(std::move(fd)) {}
+
+	libmtd_t desc_;
+	mtd_dev_info info_;
+	Fd fd_;
+};
+
+/**
+ * Library - the MTD library descriptor.
+ *
+ * Opening the library turns the C library error messages off (see
+ * 'libmtd_set_quiet()'), the errors are only reported by the results.
+ */
+class Library {
+public:
+	static Result<Library> open()
+	{
+		libmtd_set_quiet(1);
+		if (libmtd_t desc = libmtd_open())
+			return Library(desc);
+		return last_error();
+	}
+
+	static Result<Library> open_emu(const char *root)
+	{
+		libmtd_set_quiet(1);
+		if (libmtd_t desc = libmtd_open_emu(root))
+			return Library(desc);
+		return last_error();
+	}
+
+	Library(Library &&other) noexcept
+	  : desc_(std::exchange(other.desc_, nullptr)) {}
+	Library &operator=(Library &&other) noexcept
+	{
+		if (this != &other) {
+			if (desc_)
+				libmtd_close(desc_);
+			desc_ = std::exchange(other.desc_, nullptr);
+		}
+		return *this;
+	}
+	Library(const Library &) = delete;
+	Library &operator=(const Library &) = delete;
+	~Library()
+	{
+		if (desc_)
+			libmtd_close(desc_);
+	}
+
+	libmtd_t get() const noexcept { return desc_; }
+
+	Result<mtd_info> info() const
+	{
+		mtd_info info{};
+
+		if (mtd_get_info(desc_, &info))
+			return last_error();
+		return info;
+	}
+
+	bool present(int mtd_num) const
+	{
+		return mtd_dev_present(desc_, mtd_num) == 1;
+	}
+
+	Result<mtd_dev_info> dev_info(int mtd_num) const
+	{
+		mtd_dev_info info{};
+
+		if (mtd_get_dev_info1(desc_, mtd_num, &info))
+			return last_error();
+		return info;
+	}
+
+	Result<Device> open_device(int mtd_num, bool writable = true) const
+	{
+		char node[PATH_MAX];
+		mtd_dev_info info{};
+
+		if (mtd_get_dev_info1(desc_, mtd_num, &info)
+		    || mtd_dev_node(desc_, mtd_num, node, sizeof(node)))
+			return last_error();
+
+		Fd fd(::open(node, (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC));
+		if (!fd)
+			return last_error();
+
+		return Device(desc_, info, std::move(fd));
+	}
+
+private:
+	explicit Library(libmtd_t desc) noexcept : desc_(desc) {}
+
+	libmtd_t desc_ = nullptr;
+};
+
+} /* namespace mtd */
+
+#endif /* __LIBMTD_HPP__ */
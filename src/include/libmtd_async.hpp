@@ -0,0 +1,389 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * C++20 coroutine interface of the MTD library (see libmtd.hpp).
+ *
+ * The MTD erase ioctl and the MTD reads/writes block, so they are run on a
+ * ThreadPool. The coroutines themselves run on a single-threaded Executor: an
+ * awaited operation is handed to the pool and the coroutine is resumed on the
+ * executor thread once the operation completes. A single executor thread thus
+ * interleaves the flashing of many cards with any other coroutine work:
+ *
+ *	mtd::Executor ex;
+ *	mtd::ThreadPool pool(4);
+ *	mtd::AsyncDevice a(dev_a, ex, pool), b(dev_b, ex, pool);
+ *
+ *	ex.spawn(mtd::flash(a, image), [](mtd::Result<void> r) { ... });
+ *	ex.spawn(mtd::flash(b, image), [](mtd::Result<void> r) { ... });
+ *	ex.run();
+ *
+ * No memory is allocated per operation, the awaitables live in the coroutine
+ * frames and are queued to the pool intrusively. The buffers passed to the
+ * operations must stay valid until the operation is resumed. Only one
+ * operation may be in flight per AsyncDevice.
+ */
+
+#ifndef __LIBMTD_ASYNC_HPP__
+#define __LIBMTD_ASYNC_HPP__
+
+#include <algorithm>
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <optional>
+#include <span>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "libmtd.hpp"
+
+namespace mtd {
+
+/**
+ * Task - lazily started coroutine returning T, resumes its awaiter when done.
+ */
+template <typename T>
+class [[nodiscard]] Task {
+public:
+	struct promise_type {
+		std::optional<T> value;
+		std::exception_ptr exception;
+		std::coroutine_handle<> continuation;
+
+		Task get_return_object() noexcept
+		{
+			return Task(std::coroutine_handle<promise_type>::from_promise(
+			  *this));
+		}
+		std::suspend_always initial_suspend() noexcept { return {}; }
+
+		struct FinalAwaiter {
+			bool await_ready() noexcept { return false; }
+			std::coroutine_handle<> await_suspend(
+			  std::coroutine_handle<promise_type> h) noexcept
+			{
+				if (h.promise().continuation)
+					return h.promise().continuation;
+				return std::noop_coroutine();
+			}
+			void await_resume() noexcept {}
+		};
+		FinalAwaiter final_suspend() noexcept { return {}; }
+
+		void return_value(T v) { value.emplace(std::move(v)); }
+		void unhandled_exception() { exception = std::current_exception(); }
+	};
+
+	Task(Task &&other) noexcept : h_(std::exchange(other.h_, nullptr)) {}
+	Task(const Task &) = delete;
+	Task &operator=(const Task &) = delete;
+	~Task()
+	{
+		if (h_)
+			h_.destroy();
+	}
+
+	bool await_ready() const noexcept { return false; }
+	std::coroutine_handle<> await_suspend(std::coroutine_handle<> h) noexcept
+	{
+		h_.promise().continuation = h;
+		return h_;
+	}
+	T await_resume()
+	{
+		if (h_.promise().exception)
+			std::rethrow_exception(h_.promise().exception);
+		return std::move(*h_.promise().value);
+	}
+
+private:
+	explicit Task(std::coroutine_handle<promise_type> h) noexcept : h_(h) {}
+
+	std::coroutine_handle<promise_type> h_;
+};
+
+/**
+ * Executor - runs coroutines on the thread calling run().
+ */
+class Executor {
+public:
+	Executor() = default;
+	Executor(const Executor &) = delete;
+	Executor &operator=(const Executor &) = delete;
+
+	/* Queues h to be resumed on the executor thread, callable from any thread */
+	void post(std::coroutine_handle<> h)
+	{
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			ready_.push_back(h);
+		}
+		cv_.notify_one();
+	}
+
+	/* Awaitable continuing the awaiting coroutine on the executor thread */
+	auto schedule() noexcept
+	{
+		struct Awaiter {
+			Executor &ex;
+			bool await_ready() noexcept { return false; }
+			void await_suspend(std::coroutine_handle<> h) { ex.post(h); }
+			void await_resume() noexcept {}
+		};
+		return Awaiter{*this};
+	}
+
+	/*
+	 * Starts task on the executor thread and calls done with its result there
+	 * once it completes. run() returns when all the spawned tasks are done.
+	 */
+	template <typename T, typename F>
+	void spawn(Task<T> task, F done)
+	{
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			pending_++;
+		}
+		detach(std::move(task), std::move(done));
+	}
+
+	void run()
+	{
+		std::coroutine_handle<> h;
+
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(lock_);
+				cv_.wait(lock, [this] {
+					return !ready_.empty() || !pending_;
+				});
+				if (ready_.empty())
+					return;
+				h = ready_.front();
+				ready_.pop_front();
+			}
+			h.resume();
+		}
+	}
+
+private:
+	struct Detached {
+		struct promise_type {
+			Detached get_return_object() noexcept { return {}; }
+			std::suspend_never initial_suspend() noexcept { return {}; }
+			std::suspend_never final_suspend() noexcept { return {}; }
+			void return_void() noexcept {}
+			void unhandled_exception() noexcept { std::terminate(); }
+		};
+	};
+
+	template <typename T, typename F>
+	Detached detach(Task<T> task, F done)
+	{
+		co_await schedule();
+		done(co_await std::move(task));
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			pending_--;
+		}
+		cv_.notify_one();
+	}
+
+	std::mutex lock_;
+	std::condition_variable cv_;
+	std::deque<std::coroutine_handle<>> ready_;
+	size_t pending_ = 0;
+};
+
+/**
+ * Work - an item of the ThreadPool queue, linked through the item itself.
+ */
+class Work {
+public:
+	virtual void run() noexcept = 0;
+
+protected:
+	~Work() = default;
+
+private:
+	friend class ThreadPool;
+	Work *next_ = nullptr;
+};
+
+/**
+ * ThreadPool - worker threads running the blocking MTD operations.
+ */
+class ThreadPool {
+public:
+	explicit ThreadPool(unsigned threads = std::thread::hardware_concurrency())
+	{
+		threads = std::max(threads, 1U);
+		for (unsigned i = 0; i < threads; i++)
+			workers_.emplace_back([this] { worker(); });
+	}
+	ThreadPool(const ThreadPool &) = delete;
+	ThreadPool &operator=(const ThreadPool &) = delete;
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			stop_ = true;
+		}
+		cv_.notify_all();
+		for (auto &t : workers_)
+			t.join();
+	}
+
+	void submit(Work *w)
+	{
+		{
+			std::lock_guard<std::mutex> lock(lock_);
+			w->next_ = nullptr;
+			if (tail_)
+				tail_->next_ = w;
+			else
+				head_ = w;
+			tail_ = w;
+		}
+		cv_.notify_one();
+	}
+
+private:
+	void worker()
+	{
+		Work *w;
+
+		while (true) {
+			{
+				std::unique_lock<std::mutex> lock(lock_);
+				cv_.wait(lock, [this] { return head_ || stop_; });
+				if (!head_)
+					return;
+				w = head_;
+				if (!(head_ = w->next_))
+					tail_ = nullptr;
+			}
+			/* w may be gone once run() returns (its coroutine resumed) */
+			w->run();
+		}
+	}
+
+	std::mutex lock_;
+	std::condition_variable cv_;
+	Work *head_ = nullptr;
+	Work *tail_ = nullptr;
+	bool stop_ = false;
+	std::vector<std::thread> workers_;
+};
+
+/**
+ * IoOp - awaitable running fn on the pool and resuming on the executor.
+ */
+template <typename F>
+class IoOp : private Work {
+public:
+	IoOp(Executor &ex, ThreadPool &pool, F fn)
+	  : ex_(ex), pool_(pool), fn_(std::move(fn)) {}
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(std::coroutine_handle<> h)
+	{
+		h_ = h;
+		pool_.submit(this);
+	}
+	Result<void> await_resume() { return std::move(result_); }
+
+private:
+	void run() noexcept override
+	{
+		result_ = fn_();
+		ex_.post(h_);
+	}
+
+	Executor &ex_;
+	ThreadPool &pool_;
+	F fn_;
+	std::coroutine_handle<> h_;
+	Result<void> result_;
+};
+
+/**
+ * AsyncDevice - awaitable operations of an open MTD device.
+ */
+class AsyncDevice {
+public:
+	AsyncDevice(Device &dev, Executor &ex, ThreadPool &pool) noexcept
+	  : dev_(dev), ex_(ex), pool_(pool) {}
+
+	Device &device() noexcept { return dev_; }
+	const mtd_dev_info &info() const noexcept { return dev_.info(); }
+
+	auto erase(int eb, int blocks = 1)
+	{
+		return op([this, eb, blocks] { return dev_.erase(eb, blocks); });
+	}
+
+	auto read(int eb, int offs, std::span<std::byte> buf)
+	{
+		return op([this, eb, offs, buf] { return dev_.read(eb, offs, buf); });
+	}
+
+	auto write(int eb, int offs, std::span<const std::byte> data)
+	{
+		return op([this, eb, offs, data] {
+			return dev_.write(eb, offs, data);
+		});
+	}
+
+private:
+	template <typename F>
+	IoOp<F> op(F fn) { return IoOp<F>(ex_, pool_, std::move(fn)); }
+
+	Device &dev_;
+	Executor &ex_;
+	ThreadPool &pool_;
+};
+
+/**
+ * flash - erase the device and write the image to its beginning.
+ *
+ * Like 'flash_fw()', the device is erased and written eraseblock by
+ * eraseblock, so other coroutines on the executor run between the blocks.
+ */
+inline Task<Result<void>> flash(AsyncDevice &dev,
+  std::span<const std::byte> image)
+{
+	const mtd_dev_info &info = dev.info();
+	size_t offs, len;
+
+	if (image.size() > static_cast<unsigned long long>(info.size))
+		co_return std::make_error_code(std::errc::file_too_large);
+
+	for (int eb = 0; eb < info.eb_cnt; eb++)
+		if (auto r = co_await dev.erase(eb); !r)
+			co_return r;
+
+	for (offs = 0; offs < image.size(); offs += len) {
+		len = std::min<size_t>(info.eb_size, image.size() - offs);
+		if (auto r = co_await dev.write(offs / info.eb_size, 0,
+		    image.subspan(offs, len)); !r)
+			co_return r;
+	}
+
+	co_return Result<void>();
+}
+
+} /* namespace mtd */
+
+#endif /* __LIBMTD_ASYNC_HPP__ */
@@ -0,0 +1,32 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/*
+ * USDT (SystemTap SDT) static tracepoints usable with bpftrace, perf or
+ * SystemTap, e.g.:
+ *
+ *   bpftrace -l 'usdt:./fw-flash:*'
+ *
+ * A probe that no tracer is attached to costs a single nop instruction (plus
+ * keeping its arguments addressable). The probes are compiled in whenever
+ * <sys/sdt.h> (systemtap-sdt-dev(el)) is available, unless NO_SDT is defined.
+ * A build without <sys/sdt.h> and without NO_SDT warns.
+ */
+
+#if !defined(NO_SDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define HAVE_SDT
+#endif
+#endif
+
+#ifdef HAVE_SDT
+#define PROBE(provider, name, ...) STAP_PROBEV(provider, name, ##__VA_ARGS__)
+#else
+#ifndef NO_SDT
+#warning "<sys/sdt.h> not found, building without the USDT probes (define NO_SDT to leave them out)"
+#endif
+#define PROBE(provider, name, ...) do {} while (0)
+#endif
+
+#endif /* PROBES_H */
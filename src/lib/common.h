@@ -93,9 +93,15 @@ extern "C" {
 	normsg_cont(fmt "\n", ##__VA_ARGS__);                      \
 } while(0)
 
+/* Set by 'libmtd_set_quiet()', suppresses the error and warning messages */
+extern int libmtd_quiet;
+#define msg_quiet() __atomic_load_n(&libmtd_quiet, __ATOMIC_RELAXED)
+
 /* Error messages */
 #define errmsg(fmt, ...)  ({                                                \
-	fprintf(stderr, "%s: error!: " fmt "\n", PROGRAM_NAME, ##__VA_ARGS__); \
+	if (!msg_quiet())                                                   \
+		fprintf(stderr, "%s: error!: " fmt "\n", PROGRAM_NAME,      \
+			##__VA_ARGS__);                                     \
 	-1;                                                                 \
 })
 #define errmsg_die(fmt, ...) do {                                           \
@@ -106,8 +112,11 @@ extern "C" {
 #define sys_errmsg(fmt, ...)  ({                                            \
 	int _err = errno;                                                   \
 	errmsg(fmt, ##__VA_ARGS__);                                         \
-	fprintf(stderr, "%*serror %d (%s)\n", (int)sizeof(PROGRAM_NAME) + 1,\
-		"", _err, strerror(_err));                                  \
+	if (!msg_quiet())                                                   \
+		fprintf(stderr, "%*serror %d (%s)\n",                       \
+			(int)sizeof(PROGRAM_NAME) + 1, "", _err,            \
+			strerror(_err));                                    \
+	errno = _err;                                                       \
 	-1;                                                                 \
 })
 #define sys_errmsg_die(fmt, ...) do {                                       \
@@ -116,7 +125,9 @@ extern "C" {
 
 /* Warnings */
 #define warnmsg(fmt, ...) do {                                                \
-	fprintf(stderr, "%s: warning!: " fmt "\n", PROGRAM_NAME, ##__VA_ARGS__); \
+	if (!msg_quiet())                                                     \
+		fprintf(stderr, "%s: warning!: " fmt "\n", PROGRAM_NAME,      \
+			##__VA_ARGS__);                                       \
 } while(0)
 
 /* for tagging functions that always exit */
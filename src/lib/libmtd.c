@@ -27,39 +27,53 @@
 #include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
-#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/utsname.h>
+#include <sys/syscall.h>
 #include <inttypes.h>
 
 #include <mtd/mtd-user.h>
 #include <libmtd.h>
+#include <probes.h>
 
 #include "libmtd_int.h"
 #include "common.h"
 
+/* Linux limit of the 'preadv()'/'pwritev()' buffers, <limits.h> needs XOPEN */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
 /**
  * mkpath - compose full path from 2 given components.
+ * @lib: libmtd descriptor the path is stored in
  * @path: the first component
  * @name: the second component
  *
- * This function returns the resulting path in case of success and %NULL in
- * case of failure.
+ * This function stores the resulting path in the descriptor arena and returns
+ * it in case of success and %NULL in case of failure.
  */
-static char *mkpath(const char *path, const char *name)
+static char *mkpath(struct libmtd *lib, const char *path, const char *name)
 {
 	char *n;
 	size_t len1 = strlen(path);
 	size_t len2 = strlen(name);
 
-	n = xmalloc(len1 + len2 + 2);
+	if (lib->arena_used + len1 + len2 + 2 > lib->arena_size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	n = lib->arena + lib->arena_used;
 
 	memcpy(n, path, len1);
 	if (n[len1 - 1] != '/')
 		n[len1++] = '/';
 
 	memcpy(n + len1, name, len2 + 1);
+	lib->arena_used += len1 + len2 + 1;
 	return n;
 }
 
@@ -164,9 +178,14 @@ static int read_major(const char *file, int *major, int *minor)
 static int dev_get_major(struct libmtd *lib, int mtd_num, int *major, int *minor)
 {
 	char file[strlen(lib->mtd_dev) + 50];
+	uint64_t start;
+	int ret;
 
 	sprintf(file, lib->mtd_dev, mtd_num);
-	return read_major(file, major, minor);
+	start = op_stats_start();
+	ret = read_major(file, major, minor);
+	op_stats_record(mtd_num, MTD_OP_SYSFS, start);
+	return ret;
 }
 
 /**
@@ -182,9 +201,14 @@ static int dev_get_major(struct libmtd *lib, int mtd_num, int *major, int *minor
 static int dev_read_data(const char *patt, int mtd_num, void *buf, int buf_len)
 {
 	char file[strlen(patt) + 100];
+	uint64_t start;
+	int ret;
 
 	sprintf(file, patt, mtd_num);
-	return read_data(file, buf, buf_len);
+	start = op_stats_start();
+	ret = read_data(file, buf, buf_len);
+	op_stats_record(mtd_num, MTD_OP_SYSFS, start);
+	return ret;
 }
 
 /**
@@ -358,9 +382,14 @@ static int read_pos_int(const char *file, int *value)
 static int dev_read_hex_int(const char *patt, int mtd_num, int *value)
 {
 	char file[strlen(patt) + 50];
+	uint64_t start;
+	int ret;
 
 	sprintf(file, patt, mtd_num);
-	return read_hex_int(file, value);
+	start = op_stats_start();
+	ret = read_hex_int(file, value);
+	op_stats_record(mtd_num, MTD_OP_SYSFS, start);
+	return ret;
 }
 
 /**
@@ -374,9 +403,14 @@ static int dev_read_hex_int(const char *patt, int mtd_num, int *value)
 static int dev_read_pos_int(const char *patt, int mtd_num, int *value)
 {
 	char file[strlen(patt) + 50];
+	uint64_t start;
+	int ret;
 
 	sprintf(file, patt, mtd_num);
-	return read_pos_int(file, value);
+	start = op_stats_start();
+	ret = read_pos_int(file, value);
+	op_stats_record(mtd_num, MTD_OP_SYSFS, start);
+	return ret;
 }
 
 /**
@@ -390,9 +424,14 @@ static int dev_read_pos_int(const char *patt, int mtd_num, int *value)
 static int dev_read_pos_ll(const char *patt, int mtd_num, long long *value)
 {
 	char file[strlen(patt) + 50];
+	uint64_t start;
+	int ret;
 
 	sprintf(file, patt, mtd_num);
-	return read_pos_ll(file, value);
+	start = op_stats_start();
+	ret = read_pos_ll(file, value);
+	op_stats_record(mtd_num, MTD_OP_SYSFS, start);
+	return ret;
 }
 
 /**
@@ -475,6 +514,80 @@ static int dev_node2num(struct libmtd *lib, const char *node, int *mtd_num)
 	return -1;
 }
 
+struct linux_dirent64
+{
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+/**
+ * sysfs_mtd_scan - scan the MTD sysfs directory for MTD devices.
+ * @lib: MTD library descriptor
+ * @found: called with the number of every "mtdX" entry, the scan stops when
+ *         it returns non-zero
+ * @arg: argument of @found
+ *
+ * The directory is read with 'getdents64()' into a stack buffer, unlike
+ * 'opendir()' this does not allocate memory. Returns %0 in case of success and
+ * %-1 in case of failure (errno is %ENOENT if there is no MTD sysfs directory).
+ */
+static int sysfs_mtd_scan(struct libmtd *lib, int (*found)(int, void *),
+			  void *arg)
+{
+	char buf[4096] __attribute__((aligned(8)));
+	struct linux_dirent64 *dirent;
+	int fd, pos, mtd_num;
+	char tmp_buf[256];
+	long len;
+
+	fd = open(lib->sysfs_mtd, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd == -1) {
+		if (errno == ENOENT)
+			return -1;
+		return sys_errmsg("cannot open \"%s\"", lib->sysfs_mtd);
+	}
+
+	while ((len = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+		for (pos = 0; pos < len; pos += dirent->d_reclen) {
+			dirent = (struct linux_dirent64 *)(buf + pos);
+
+			if (strlen(dirent->d_name) >= 255) {
+				errmsg("invalid entry in %s: \"%s\"",
+				       lib->sysfs_mtd, dirent->d_name);
+				errno = EINVAL;
+				goto out_close;
+			}
+
+			if (sscanf(dirent->d_name, MTD_NAME_PATT"%s",
+				   &mtd_num, tmp_buf) == 1 &&
+			    found(mtd_num, arg))
+				goto out;
+		}
+	}
+	if (len < 0) {
+		sys_errmsg("cannot read \"%s\"", lib->sysfs_mtd);
+		goto out_close;
+	}
+
+out:
+	if (close(fd))
+		return sys_errmsg("close failed on \"%s\"", lib->sysfs_mtd);
+	return 0;
+
+out_close:
+	close(fd);
+	return -1;
+}
+
+static int first_mtd(int mtd_num, void *arg)
+{
+	*(int *)arg = mtd_num;
+	return 1;
+}
+
 /**
  * sysfs_is_supported - check whether the MTD sub-system supports MTD.
  * @lib: MTD library descriptor
@@ -494,50 +607,20 @@ static int dev_node2num(struct libmtd *lib, const char *node, int *mtd_num)
 static int sysfs_is_supported(struct libmtd *lib)
 {
 	int fd, num = -1;
-	DIR *sysfs_mtd;
 	char file[strlen(lib->mtd_name) + 10];
 
-	sysfs_mtd = opendir(lib->sysfs_mtd);
-	if (!sysfs_mtd) {
-		if (errno == ENOENT) {
-			errno = 0;
-			return 0;
-		}
-		return sys_errmsg("cannot open \"%s\"", lib->sysfs_mtd);
-	}
-
 	/*
 	 * First of all find an "mtdX" directory. This is needed because there
 	 * may be, for example, mtd1 but no mtd0.
 	 */
-	while (1) {
-		int ret, mtd_num;
-		char tmp_buf[256];
-		struct dirent *dirent;
-
-		dirent = readdir(sysfs_mtd);
-		if (!dirent)
-			break;
-
-		if (strlen(dirent->d_name) >= 255) {
-			errmsg("invalid entry in %s: \"%s\"",
-			       lib->sysfs_mtd, dirent->d_name);
-			errno = EINVAL;
-			closedir(sysfs_mtd);
-			return -1;
-		}
-
-		ret = sscanf(dirent->d_name, MTD_NAME_PATT"%s",
-			     &mtd_num, tmp_buf);
-		if (ret == 1) {
-			num = mtd_num;
-			break;
+	if (sysfs_mtd_scan(lib, first_mtd, &num)) {
+		if (errno == ENOENT) {
+			errno = 0;
+			return 0;
 		}
+		return -1;
 	}
 
-	if (closedir(sysfs_mtd))
-		return sys_errmsg("closedir failed on \"%s\"", lib->sysfs_mtd);
-
 	if (num == -1)
 		/* No mtd device, treat this as pre-sysfs system */
 		return 0;
@@ -555,107 +638,219 @@ static int sysfs_is_supported(struct libmtd *lib)
 	return 1;
 }
 
-libmtd_t libmtd_open(void)
+/**
+ * offs64_ioctls_probe - find out whether the 64-bit offset ioctls are supported.
+ * @lib: MTD library descriptor
+ *
+ * The %MEMERASE64, %MEMREADOOB64 and %MEMWRITEOOB64 ioctls were added
+ * together in kernel version 2.6.31. Kernels that know %MEMERASE64 refuse it
+ * on a read-only MTD device node with %EPERM before anything is erased, older
+ * kernels fail with %ENOTTY. Without any MTD device node to ask, the kernel
+ * version decides. Returns %OFFS64_IOCTLS_SUPPORTED or
+ * %OFFS64_IOCTLS_NOT_SUPPORTED.
+ */
+static int offs64_ioctls_probe(struct libmtd *lib)
+{
+	struct erase_info_user64 ei64 = {0, 0};
+	struct mtd_info info;
+	struct utsname uts;
+	char node[PATH_MAX];
+	int i, fd, ret, major, minor, patch;
+
+	/* The emulated device nodes are regular files, the ioctls are not used */
+	if (emu_enabled())
+		return OFFS64_IOCTLS_SUPPORTED;
+
+	if (mtd_get_info(lib, &info) == 0) {
+		for (i = info.lowest_mtd_num; i <= info.highest_mtd_num; i++) {
+			if (mtd_dev_node(lib, i, node, sizeof(node)) < 0)
+				continue;
+			fd = open(node, O_RDONLY | O_CLOEXEC);
+			if (fd < 0)
+				continue;
+			ret = ioctl(fd, MEMERASE64, &ei64);
+			close(fd);
+			if (ret < 0 && errno == ENOTTY)
+				return OFFS64_IOCTLS_NOT_SUPPORTED;
+			return OFFS64_IOCTLS_SUPPORTED;
+		}
+	}
+
+	if (uname(&uts) == 0 &&
+	    sscanf(uts.release, "%d.%d.%d", &major, &minor, &patch) == 3 &&
+	    (major << 16 | minor << 8 | patch) < (2 << 16 | 6 << 8 | 31))
+		return OFFS64_IOCTLS_NOT_SUPPORTED;
+
+	return OFFS64_IOCTLS_SUPPORTED;
+}
+
+/**
+ * open_root - open MTD library on given sysfs and device node directories.
+ * @sysfs_root: sysfs root directory
+ * @dev_root: directory of the MTD device nodes
+ * @legacy: non-zero if falling back to /proc/mtd is allowed
+ *
+ * This function is the common part of 'libmtd_open()' and 'libmtd_open_emu()'.
+ */
+static libmtd_t open_root(const char *sysfs_root, const char *dev_root,
+			  int legacy)
 {
 	struct libmtd *lib;
+	size_t size;
 
-	lib = xzalloc(sizeof(*lib));
+	/* Upper bound of the total length of all the paths */
+	size = MTD_PATHS_CNT * (MAX(strlen(sysfs_root), strlen(dev_root)) +
+				sizeof(SYSFS_MTD) + sizeof(MTD_NAME_PATT) +
+				MTD_FILE_MAX + 1);
 
-	lib->offs64_ioctls = OFFS64_IOCTLS_UNKNOWN;
+	lib = xzalloc(sizeof(*lib) + size);
+	lib->arena_size = size;
 
-	lib->sysfs_mtd = mkpath(SYSFS_ROOT, SYSFS_MTD);
+	lib->dev_node = mkpath(lib, dev_root, MTD_NAME_PATT);
+	if (!lib->dev_node)
+		goto out_error;
+
+	lib->sysfs_mtd = mkpath(lib, sysfs_root, SYSFS_MTD);
 	if (!lib->sysfs_mtd)
 		goto out_error;
 
-	lib->mtd = mkpath(lib->sysfs_mtd, MTD_NAME_PATT);
+	lib->mtd = mkpath(lib, lib->sysfs_mtd, MTD_NAME_PATT);
 	if (!lib->mtd)
 		goto out_error;
 
-	lib->mtd_name = mkpath(lib->mtd, MTD_NAME);
+	lib->mtd_name = mkpath(lib, lib->mtd, MTD_NAME);
 	if (!lib->mtd_name)
 		goto out_error;
 
 	if (!sysfs_is_supported(lib)) {
-		free(lib->mtd);
-		free(lib->sysfs_mtd);
-		free(lib->mtd_name);
 		lib->mtd_name = lib->mtd = lib->sysfs_mtd = NULL;
 
-		if (!legacy_procfs_is_supported()) {
+		if (!legacy || !legacy_procfs_is_supported()) {
 			free(lib);
-			lib = NULL;
+			return NULL;
 		}
+		lib->offs64_ioctls = offs64_ioctls_probe(lib);
 		return lib;
 	}
 
-	lib->mtd_dev = mkpath(lib->mtd, MTD_DEV);
+	lib->mtd_dev = mkpath(lib, lib->mtd, MTD_DEV);
 	if (!lib->mtd_dev)
 		goto out_error;
 
-	lib->mtd_type = mkpath(lib->mtd, MTD_TYPE);
+	lib->mtd_type = mkpath(lib, lib->mtd, MTD_TYPE);
 	if (!lib->mtd_type)
 		goto out_error;
 
-	lib->mtd_eb_size = mkpath(lib->mtd, MTD_EB_SIZE);
+	lib->mtd_eb_size = mkpath(lib, lib->mtd, MTD_EB_SIZE);
 	if (!lib->mtd_eb_size)
 		goto out_error;
 
-	lib->mtd_size = mkpath(lib->mtd, MTD_SIZE);
+	lib->mtd_size = mkpath(lib, lib->mtd, MTD_SIZE);
 	if (!lib->mtd_size)
 		goto out_error;
 
-	lib->mtd_min_io_size = mkpath(lib->mtd, MTD_MIN_IO_SIZE);
+	lib->mtd_min_io_size = mkpath(lib, lib->mtd, MTD_MIN_IO_SIZE);
 	if (!lib->mtd_min_io_size)
 		goto out_error;
 
-	lib->mtd_subpage_size = mkpath(lib->mtd, MTD_SUBPAGE_SIZE);
+	lib->mtd_subpage_size = mkpath(lib, lib->mtd, MTD_SUBPAGE_SIZE);
 	if (!lib->mtd_subpage_size)
 		goto out_error;
 
-	lib->mtd_oob_size = mkpath(lib->mtd, MTD_OOB_SIZE);
+	lib->mtd_oob_size = mkpath(lib, lib->mtd, MTD_OOB_SIZE);
 	if (!lib->mtd_oob_size)
 		goto out_error;
 
-	lib->mtd_oobavail = mkpath(lib->mtd, MTD_OOBAVAIL);
+	lib->mtd_oobavail = mkpath(lib, lib->mtd, MTD_OOBAVAIL);
 	if (!lib->mtd_oobavail)
 		goto out_error;
 
-	lib->mtd_region_cnt = mkpath(lib->mtd, MTD_REGION_CNT);
+	lib->mtd_region_cnt = mkpath(lib, lib->mtd, MTD_REGION_CNT);
 	if (!lib->mtd_region_cnt)
 		goto out_error;
 
-	lib->mtd_flags = mkpath(lib->mtd, MTD_FLAGS);
+	lib->mtd_flags = mkpath(lib, lib->mtd, MTD_FLAGS);
 	if (!lib->mtd_flags)
 		goto out_error;
 
 	lib->sysfs_supported = 1;
+	lib->offs64_ioctls = offs64_ioctls_probe(lib);
 	return lib;
 
 out_error:
-	libmtd_close((libmtd_t)lib);
+	free(lib);
 	return NULL;
 }
 
+libmtd_t libmtd_open(void)
+{
+	libmtd_t desc;
+
+	if (emu_real_get())
+		return NULL;
+
+	desc = open_root(SYSFS_ROOT, DEV_ROOT, 1);
+	if (!desc)
+		emu_real_put();
+
+	return desc;
+}
+
+libmtd_t libmtd_open_emu(const char *root)
+{
+	char sysfs_root[strlen(root) + sizeof(EMU_SYSFS)];
+	char dev_root[strlen(root) + sizeof(EMU_DEV)];
+
+	struct libmtd *lib;
+
+	if (emu_get(root))
+		return NULL;
+
+	sprintf(sysfs_root, "%s" EMU_SYSFS, root);
+	sprintf(dev_root, "%s" EMU_DEV, root);
+
+	lib = (struct libmtd *)open_root(sysfs_root, dev_root, 0);
+	if (!lib) {
+		emu_put();
+		return NULL;
+	}
+	lib->emu = 1;
+
+	return lib;
+}
+
 void libmtd_close(libmtd_t desc)
 {
 	struct libmtd *lib = (struct libmtd *)desc;
 
-	free(lib->mtd_flags);
-	free(lib->mtd_region_cnt);
-	free(lib->mtd_oob_size);
-	free(lib->mtd_oobavail);
-	free(lib->mtd_subpage_size);
-	free(lib->mtd_min_io_size);
-	free(lib->mtd_size);
-	free(lib->mtd_eb_size);
-	free(lib->mtd_type);
-	free(lib->mtd_dev);
-	free(lib->mtd_name);
-	free(lib->mtd);
-	free(lib->sysfs_mtd);
+	if (lib->emu)
+		emu_put();
+	else
+		emu_real_put();
 	free(lib);
 }
 
+int libmtd_quiet;
+
+void libmtd_set_quiet(int quiet)
+{
+	__atomic_store_n(&libmtd_quiet, !!quiet, __ATOMIC_RELAXED);
+}
+
+int mtd_dev_node(libmtd_t desc, int mtd_num, char *buf, size_t size)
+{
+	struct libmtd *lib = (struct libmtd *)desc;
+	int ret;
+
+	ret = snprintf(buf, size, lib->dev_node, mtd_num);
+	if (ret < 0 || (size_t)ret >= size) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+
+	return 0;
+}
+
 int mtd_dev_present(libmtd_t desc, int mtd_num) {
 	struct stat st;
 	struct libmtd *lib = (struct libmtd *)desc;
@@ -670,10 +865,20 @@ int mtd_dev_present(libmtd_t desc, int mtd_num) {
 	}
 }
 
+static int count_mtd(int mtd_num, void *arg)
+{
+	struct mtd_info *info = arg;
+
+	info->mtd_dev_cnt += 1;
+	if (mtd_num > info->highest_mtd_num)
+		info->highest_mtd_num = mtd_num;
+	if (mtd_num < info->lowest_mtd_num)
+		info->lowest_mtd_num = mtd_num;
+	return 0;
+}
+
 int mtd_get_info(libmtd_t desc, struct mtd_info *info)
 {
-	DIR *sysfs_mtd;
-	struct dirent *dirent;
 	struct libmtd *lib = (struct libmtd *)desc;
 
 	memset(info, 0, sizeof(struct mtd_info));
@@ -687,54 +892,17 @@ int mtd_get_info(libmtd_t desc, struct mtd_info *info)
 	 * We have to scan the MTD sysfs directory to identify how many MTD
 	 * devices are present.
 	 */
-	sysfs_mtd = opendir(lib->sysfs_mtd);
-	if (!sysfs_mtd)
-		return sys_errmsg("cannot open \"%s\"", lib->sysfs_mtd);
-
 	info->lowest_mtd_num = INT_MAX;
-	while (1) {
-		int mtd_num, ret;
-		char tmp_buf[256];
-
-		errno = 0;
-		dirent = readdir(sysfs_mtd);
-		if (!dirent)
-			break;
-
-		if (strlen(dirent->d_name) >= 255) {
-			errmsg("invalid entry in %s: \"%s\"",
-			       lib->sysfs_mtd, dirent->d_name);
-			errno = EINVAL;
-			goto out_close;
-		}
-
-		ret = sscanf(dirent->d_name, MTD_NAME_PATT"%s",
-			     &mtd_num, tmp_buf);
-		if (ret == 1) {
-			info->mtd_dev_cnt += 1;
-			if (mtd_num > info->highest_mtd_num)
-				info->highest_mtd_num = mtd_num;
-			if (mtd_num < info->lowest_mtd_num)
-				info->lowest_mtd_num = mtd_num;
-		}
-	}
-
-	if (!dirent && errno) {
-		sys_errmsg("readdir failed on \"%s\"", lib->sysfs_mtd);
-		goto out_close;
+	if (sysfs_mtd_scan(lib, count_mtd, info)) {
+		if (errno == ENOENT)
+			sys_errmsg("cannot open \"%s\"", lib->sysfs_mtd);
+		return -1;
 	}
 
-	if (closedir(sysfs_mtd))
-		return sys_errmsg("closedir failed on \"%s\"", lib->sysfs_mtd);
-
 	if (info->lowest_mtd_num == INT_MAX)
 		info->lowest_mtd_num = 0;
 
 	return 0;
-
-out_close:
-	closedir(sysfs_mtd);
-	return -1;
 }
 
 int mtd_get_dev_info1(libmtd_t desc, int mtd_num, struct mtd_dev_info *mtd)
@@ -816,6 +984,30 @@ int mtd_get_dev_info(libmtd_t desc, const char *node, struct mtd_dev_info *mtd)
 	return mtd_get_dev_info1(desc, mtd_num, mtd);
 }
 
+int mtd_get_dev_stamp(libmtd_t desc, int mtd_num, int *major, int *minor,
+		      unsigned long long *ino)
+{
+	struct stat st;
+	struct libmtd *lib = (struct libmtd *)desc;
+
+	if (!lib->sysfs_supported) {
+		errno = EOPNOTSUPP;
+		return -1;
+	} else {
+		char file[strlen(lib->mtd) + 10];
+
+		sprintf(file, lib->mtd, mtd_num);
+		if (lstat(file, &st))
+			return -1;
+	}
+
+	if (dev_get_major(lib, mtd_num, major, minor))
+		return -1;
+	*ino = st.st_ino;
+
+	return 0;
+}
+
 static inline int mtd_ioctl_error(const struct mtd_dev_info *mtd, int eb,
 				  const char *sreq)
 {
@@ -865,8 +1057,8 @@ int mtd_unlock(const struct mtd_dev_info *mtd, int fd, int eb)
 	return mtd_xlock(mtd, fd, eb, MEMUNLOCK);
 }
 
-int mtd_erase_multi(libmtd_t desc, const struct mtd_dev_info *mtd,
-			int fd, int eb, int blocks)
+static int do_erase(libmtd_t desc, const struct mtd_dev_info *mtd,
+		    int fd, int eb, int blocks)
 {
 	int ret;
 	struct libmtd *lib = (struct libmtd *)desc;
@@ -884,22 +1076,14 @@ int mtd_erase_multi(libmtd_t desc, const struct mtd_dev_info *mtd,
 	ei64.start = (__u64)eb * mtd->eb_size;
 	ei64.length = (__u64)mtd->eb_size * blocks;
 
-	if (lib->offs64_ioctls == OFFS64_IOCTLS_SUPPORTED ||
-	    lib->offs64_ioctls == OFFS64_IOCTLS_UNKNOWN) {
-		ret = ioctl(fd, MEMERASE64, &ei64);
-		if (ret == 0)
-			return ret;
+	if (emu_enabled())
+		return emu_erase(mtd, fd, ei64.start, ei64.length);
 
-		if (errno != ENOTTY ||
-		    lib->offs64_ioctls != OFFS64_IOCTLS_UNKNOWN)
+	if (lib->offs64_ioctls == OFFS64_IOCTLS_SUPPORTED) {
+		ret = ioctl(fd, MEMERASE64, &ei64);
+		if (ret < 0)
 			return mtd_ioctl_error(mtd, eb, "MEMERASE64");
-
-		/*
-		 * MEMERASE64 support was added in kernel version 2.6.31, so
-		 * probably we are working with older kernel and this ioctl is
-		 * not supported.
-		 */
-		lib->offs64_ioctls = OFFS64_IOCTLS_NOT_SUPPORTED;
+		return 0;
 	}
 
 	if (ei64.start + ei64.length > 0xFFFFFFFF) {
@@ -917,6 +1101,19 @@ int mtd_erase_multi(libmtd_t desc, const struct mtd_dev_info *mtd,
 	return 0;
 }
 
+int mtd_erase_multi(libmtd_t desc, const struct mtd_dev_info *mtd,
+			int fd, int eb, int blocks)
+{
+	uint64_t start = op_stats_start();
+	int ret;
+
+	PROBE(libmtd, erase_start, mtd->mtd_num, eb, blocks);
+	ret = do_erase(desc, mtd, fd, eb, blocks);
+	op_stats_record(mtd->mtd_num, MTD_OP_ERASE, start);
+	PROBE(libmtd, erase_done, mtd->mtd_num, eb, blocks, ret);
+	return ret;
+}
+
 int mtd_erase(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb)
 {
 	return mtd_erase_multi(desc, mtd, fd, eb, 1);
@@ -963,35 +1160,44 @@ int mtd_is_locked(const struct mtd_dev_info *mtd, int fd, int eb)
 /* Patterns to write to a physical eraseblock when torturing it */
 static uint8_t patterns[] = {0xa5, 0x5a, 0x0};
 
-/**
- * check_pattern - check if buffer contains only a certain byte pattern.
- * @buf: buffer to check
- * @patt: the pattern to check
- * @size: buffer size in bytes
- *
- * This function returns %0 if there are only @patt bytes in @buf, and %-1 if
- * something else was also found.
+/*
+ * 32 bytes compared at once, GCC compiles the vector operations to the SIMD
+ * instructions of the target (SSE2/AVX2, NEON) or to 64-bit scalar code.
  */
-static int check_pattern(const void *buf, uint8_t patt, int size)
+typedef uint64_t patt_vec __attribute__((vector_size(32)));
+
+int mtd_check_pattern(const void *buf, uint8_t patt, int size)
 {
-	int i;
+	const uint8_t *p = buf;
+	uint64_t p64 = patt * 0x0101010101010101ULL;
+	patt_vec v, diff, pv = {p64, p64, p64, p64};
+	int i = 0, j;
+
+	/* Find the first 128 bytes with a mismatch, the bytes tell where */
+	for (; i + 4 * (int)sizeof(v) <= size; i += 4 * sizeof(v)) {
+		diff = (patt_vec){0, 0, 0, 0};
+		for (j = 0; j < 4; j++) {
+			memcpy(&v, p + i + j * sizeof(v), sizeof(v));
+			diff |= v ^ pv;
+		}
+		if (diff[0] | diff[1] | diff[2] | diff[3])
+			break;
+	}
+	for (; i < size; i++)
+		if (p[i] != patt)
+			return i;
 
-	for (i = 0; i < size; i++)
-		if (((const uint8_t *)buf)[i] != patt)
-			return -1;
-	return 0;
+	return -1;
 }
 
-int mtd_torture(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb)
+int mtd_torture_buf(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+		    int eb, void *buf)
 {
 	int err, i, patt_count;
-	void *buf;
 
 	normsg("run torture test for PEB %d", eb);
 	patt_count = ARRAY_SIZE(patterns);
 
-	buf = xmalloc(mtd->eb_size);
-
 	for (i = 0; i < patt_count; i++) {
 		err = mtd_erase(desc, mtd, fd, eb);
 		if (err)
@@ -1002,10 +1208,10 @@ int mtd_torture(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb)
 		if (err)
 			goto out;
 
-		err = check_pattern(buf, 0xFF, mtd->eb_size);
-		if (err) {
+		if (mtd_check_pattern(buf, 0xFF, mtd->eb_size) >= 0) {
 			errmsg("erased PEB %d, but a non-0xFF byte found", eb);
 			errno = EIO;
+			err = -1;
 			goto out;
 		}
 
@@ -1021,11 +1227,11 @@ int mtd_torture(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb)
 		if (err)
 			goto out;
 
-		err = check_pattern(buf, patterns[i], mtd->eb_size);
-		if (err) {
+		if (mtd_check_pattern(buf, patterns[i], mtd->eb_size) >= 0) {
 			errmsg("pattern %x checking failed for PEB %d",
 				patterns[i], eb);
 			errno = EIO;
+			err = -1;
 			goto out;
 		}
 	}
@@ -1034,7 +1240,18 @@ int mtd_torture(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb)
 	normsg("PEB %d passed torture test, do not mark it a bad", eb);
 
 out:
+	return err;
+}
+
+int mtd_torture(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb)
+{
+	int err;
+	void *buf;
+
+	buf = xmalloc(mtd->eb_size);
+	err = mtd_torture_buf(desc, mtd, fd, eb, buf);
 	free(buf);
+
 	return err;
 }
 
@@ -1078,10 +1295,85 @@ int mtd_mark_bad(const struct mtd_dev_info *mtd, int fd, int eb)
 	return 0;
 }
 
-int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
-	     void *buf, int len)
+/**
+ * pio - positional read or write of a whole buffer.
+ * @fd: file descriptor
+ * @buf: buffer to read to or write from
+ * @len: how many bytes to transfer
+ * @seek: file offset to transfer at
+ * @wr: write if non-zero, read otherwise
+ *
+ * The file offset of @fd is not used, so the same file descriptor may be used
+ * by multiple threads at the same time. Short transfers are continued, an
+ * unexpected end of file fails with %EIO. Returns %0 in case of success and
+ * %-1 in case of failure.
+ */
+static int pio(int fd, void *buf, size_t len, off_t seek, int wr)
+{
+	ssize_t ret;
+
+	while (len) {
+		ret = wr ? pwrite(fd, buf, len, seek) : pread(fd, buf, len, seek);
+		if (ret <= 0) {
+			if (!ret)
+				errno = EIO;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+		seek += ret;
+	}
+
+	return 0;
+}
+
+/**
+ * piov - positional scatter/gather read or write.
+ * @fd: file descriptor
+ * @iov: buffers to read to or write from
+ * @iovcnt: count of @iov buffers
+ * @seek: file offset to transfer at
+ * @wr: write if non-zero, read otherwise
+ *
+ * Like 'pio()', but the contiguous file range is transferred to/from the
+ * @iov buffers in a single 'preadv()'/'pwritev()' call (per %IOV_MAX
+ * buffers). A buffer transferred only partially is finished with 'pio()'.
+ */
+static int piov(int fd, const struct iovec *iov, int iovcnt, off_t seek,
+		int wr)
 {
-	int ret, rd = 0;
+	ssize_t ret;
+	int i = 0;
+
+	while (i < iovcnt) {
+		ret = wr ? pwritev(fd, iov + i, MIN(iovcnt - i, IOV_MAX), seek)
+			 : preadv(fd, iov + i, MIN(iovcnt - i, IOV_MAX), seek);
+		if (ret <= 0) {
+			if (!ret)
+				errno = EIO;
+			return -1;
+		}
+		seek += ret;
+
+		/* Skip the complete buffers, finish the partial one */
+		for (; i < iovcnt && (size_t)ret >= iov[i].iov_len; i++)
+			ret -= iov[i].iov_len;
+		if (ret) {
+			if (pio(fd, iov[i].iov_base + ret, iov[i].iov_len - ret,
+				seek, wr))
+				return -1;
+			seek += iov[i].iov_len - ret;
+			i++;
+		}
+	}
+
+	return 0;
+}
+
+static int do_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+		   void *buf, int len)
+{
+	int ret;
 	off_t seek;
 
 	ret = mtd_valid_erase_block(mtd, eb);
@@ -1095,34 +1387,48 @@ int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
 		return -1;
 	}
 
-	/* Seek to the beginning of the eraseblock */
 	seek = (off_t)eb * mtd->eb_size + offs;
-	if (lseek(fd, seek, SEEK_SET) != seek)
-		return sys_errmsg("cannot seek mtd%d to offset %lld",
-				  mtd->mtd_num, (long long)seek);
+	if (pio(fd, buf, len, seek, 0))
+		return sys_errmsg("cannot read %d bytes from mtd%d (eraseblock %d, offset %d)",
+				  len, mtd->mtd_num, eb, offs);
 
-	while (rd < len) {
-		ret = read(fd, buf + rd, len - rd);
-		if (ret < 0)
-			return sys_errmsg("cannot read %d bytes from mtd%d (eraseblock %d, offset %d)",
-					  len - rd, mtd->mtd_num, eb, offs + rd);
-		rd += ret;
-	}
+	if (emu_enabled())
+		emu_read_delay(len);
 
 	return 0;
 }
 
+int mtd_read(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	     void *buf, int len)
+{
+	uint64_t start = op_stats_start();
+	int ret;
+
+	PROBE(libmtd, read_start, mtd->mtd_num, eb, offs, len);
+	ret = do_read(mtd, fd, eb, offs, buf, len);
+	op_stats_record(mtd->mtd_num, MTD_OP_READ, start);
+	PROBE(libmtd, read_done, mtd->mtd_num, eb, offs, len, ret);
+	return ret;
+}
+
 static int legacy_auto_oob_layout(const struct mtd_dev_info *mtd, int fd,
 				  int ooblen, void *oob) {
 	struct nand_oobinfo old_oobinfo;
 	int start, len;
-	uint8_t *tmp_buf;
+
+	if (ooblen < 0 || ooblen > mtd->oob_size) {
+		errmsg("bad OOB length %d, mtd%d OOB size is %d",
+		       ooblen, mtd->mtd_num, mtd->oob_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	uint8_t tmp_buf[ooblen];
 
 	/* Read the current oob info */
 	if (ioctl(fd, MEMGETOOBSEL, &old_oobinfo))
 		return sys_errmsg("MEMGETOOBSEL failed");
 
-	tmp_buf = malloc(ooblen);
 	memcpy(tmp_buf, oob, ooblen);
 
 	/*
@@ -1145,13 +1451,12 @@ static int legacy_auto_oob_layout(const struct mtd_dev_info *mtd, int fd,
 		memcpy(oob + start, tmp_buf + start, len);
 	}
 
-	free(tmp_buf);
 	return 0;
 }
 
-int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
-	      int offs, void *data, int len, void *oob, int ooblen,
-	      uint8_t mode)
+static int do_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+		    int eb, int offs, void *data, int len, void *oob,
+		    int ooblen, uint8_t mode)
 {
 	int ret;
 	off_t seek;
@@ -1205,21 +1510,224 @@ int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
 		if (mtd_write_oob(desc, mtd, fd, seek, ooblen, oob) < 0)
 			return sys_errmsg("cannot write to OOB");
 	}
-	if (data) {
-		/* Seek to the beginning of the eraseblock */
-		if (lseek(fd, seek, SEEK_SET) != seek)
-			return sys_errmsg("cannot seek mtd%d to offset %lld",
-					mtd->mtd_num, (long long)seek);
-		ret = write(fd, data, len);
-		if (ret != len)
-			return sys_errmsg("cannot write %d bytes to mtd%d "
-					  "(eraseblock %d, offset %d)",
-					  len, mtd->mtd_num, eb, offs);
+	if (data && emu_enabled())
+		return emu_write(mtd, fd, seek, data, len);
+	if (data && pio(fd, data, len, seek, 1))
+		return sys_errmsg("cannot write %d bytes to mtd%d "
+				  "(eraseblock %d, offset %d)",
+				  len, mtd->mtd_num, eb, offs);
+
+	return 0;
+}
+
+int mtd_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd, int eb,
+	      int offs, void *data, int len, void *oob, int ooblen,
+	      uint8_t mode)
+{
+	uint64_t start = op_stats_start();
+	int ret;
+
+	PROBE(libmtd, write_start, mtd->mtd_num, eb, offs, len);
+	ret = do_write(desc, mtd, fd, eb, offs, data, len, oob, ooblen, mode);
+	op_stats_record(mtd->mtd_num, MTD_OP_WRITE, start);
+	PROBE(libmtd, write_done, mtd->mtd_num, eb, offs, len, ret);
+	return ret;
+}
+
+static int check_multi(const struct mtd_dev_info *mtd, int eb, int offs,
+		       int len)
+{
+	int ret;
+
+	ret = mtd_valid_erase_block(mtd, eb);
+	if (ret)
+		return ret;
+
+	if (offs < 0 || offs >= mtd->eb_size || len < 0 ||
+	    (long long)eb * mtd->eb_size + offs + len > mtd->size) {
+		errmsg("bad offset %d or length %d, mtd%d size is %lld",
+		       offs, len, mtd->mtd_num, mtd->size);
+		errno = EINVAL;
+		return -1;
 	}
 
 	return 0;
 }
 
+static int do_read_multi(const struct mtd_dev_info *mtd, int fd, int eb,
+			 int offs, void *buf, int len)
+{
+	int ret;
+	off_t seek;
+
+	ret = check_multi(mtd, eb, offs, len);
+	if (ret)
+		return ret;
+
+	seek = (off_t)eb * mtd->eb_size + offs;
+	if (pio(fd, buf, len, seek, 0))
+		return sys_errmsg("cannot read %d bytes from mtd%d (offset %lld)",
+				  len, mtd->mtd_num, (long long)seek);
+
+	if (emu_enabled())
+		emu_read_delay(len);
+
+	return 0;
+}
+
+static int do_write_multi(const struct mtd_dev_info *mtd, int fd, int eb,
+			  int offs, const void *data, int len)
+{
+	int ret;
+	off_t seek;
+
+	ret = check_multi(mtd, eb, offs, len);
+	if (ret)
+		return ret;
+
+	if (offs % mtd->subpage_size || len % mtd->subpage_size) {
+		errmsg("write offset %d or length %d is not aligned to mtd%d min. I/O size %d",
+		       offs, len, mtd->mtd_num, mtd->subpage_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	seek = (off_t)eb * mtd->eb_size + offs;
+	if (emu_enabled())
+		return emu_write(mtd, fd, seek, data, len);
+
+	if (pio(fd, (void *)data, len, seek, 1))
+		return sys_errmsg("cannot write %d bytes to mtd%d (offset %lld)",
+				  len, mtd->mtd_num, (long long)seek);
+
+	return 0;
+}
+
+/* Returns the total length of the @iov buffers or %-1 if it exceeds %INT_MAX */
+static int iov_len(const struct iovec *iov, int iovcnt)
+{
+	long long len = 0;
+	int i;
+
+	for (i = 0; i < iovcnt && len <= INT_MAX; i++)
+		len += iov[i].iov_len;
+
+	return len > INT_MAX ? -1 : len;
+}
+
+static int do_readv(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+		    const struct iovec *iov, int iovcnt, int len)
+{
+	int ret;
+	off_t seek;
+
+	ret = check_multi(mtd, eb, offs, len);
+	if (ret)
+		return ret;
+
+	seek = (off_t)eb * mtd->eb_size + offs;
+	if (piov(fd, iov, iovcnt, seek, 0))
+		return sys_errmsg("cannot read %d bytes from mtd%d (offset %lld)",
+				  len, mtd->mtd_num, (long long)seek);
+
+	if (emu_enabled())
+		emu_read_delay(len);
+
+	return 0;
+}
+
+static int do_writev(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+		     const struct iovec *iov, int iovcnt, int len)
+{
+	int i, ret;
+	off_t seek;
+
+	ret = check_multi(mtd, eb, offs, len);
+	if (ret)
+		return ret;
+
+	/* The MTD character device writes the buffers one by one */
+	for (i = 0; i < iovcnt; i++) {
+		if (iov[i].iov_len % mtd->subpage_size)
+			break;
+	}
+	if (offs % mtd->subpage_size || i < iovcnt) {
+		errmsg("write offset %d or buffer length is not aligned to mtd%d min. I/O size %d",
+		       offs, mtd->mtd_num, mtd->subpage_size);
+		errno = EINVAL;
+		return -1;
+	}
+
+	seek = (off_t)eb * mtd->eb_size + offs;
+	if (emu_enabled()) {
+		for (i = 0; i < iovcnt; seek += iov[i++].iov_len) {
+			ret = emu_write(mtd, fd, seek, iov[i].iov_base,
+					iov[i].iov_len);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	if (piov(fd, iov, iovcnt, seek, 1))
+		return sys_errmsg("cannot write %d bytes to mtd%d (offset %lld)",
+				  len, mtd->mtd_num, (long long)seek);
+
+	return 0;
+}
+
+int mtd_read_multi(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+		   void *buf, int len)
+{
+	uint64_t start = op_stats_start();
+	int ret;
+
+	PROBE(libmtd, read_start, mtd->mtd_num, eb, offs, len);
+	ret = do_read_multi(mtd, fd, eb, offs, buf, len);
+	op_stats_record(mtd->mtd_num, MTD_OP_READ, start);
+	PROBE(libmtd, read_done, mtd->mtd_num, eb, offs, len, ret);
+	return ret;
+}
+
+int mtd_write_multi(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+		    const void *data, int len)
+{
+	uint64_t start = op_stats_start();
+	int ret;
+
+	PROBE(libmtd, write_start, mtd->mtd_num, eb, offs, len);
+	ret = do_write_multi(mtd, fd, eb, offs, data, len);
+	op_stats_record(mtd->mtd_num, MTD_OP_WRITE, start);
+	PROBE(libmtd, write_done, mtd->mtd_num, eb, offs, len, ret);
+	return ret;
+}
+
+int mtd_readv(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	      const struct iovec *iov, int iovcnt)
+{
+	uint64_t start = op_stats_start();
+	int ret, len = iov_len(iov, iovcnt);
+
+	PROBE(libmtd, read_start, mtd->mtd_num, eb, offs, len);
+	ret = do_readv(mtd, fd, eb, offs, iov, iovcnt, len);
+	op_stats_record(mtd->mtd_num, MTD_OP_READ, start);
+	PROBE(libmtd, read_done, mtd->mtd_num, eb, offs, len, ret);
+	return ret;
+}
+
+int mtd_writev(const struct mtd_dev_info *mtd, int fd, int eb, int offs,
+	       const struct iovec *iov, int iovcnt)
+{
+	uint64_t start = op_stats_start();
+	int ret, len = iov_len(iov, iovcnt);
+
+	PROBE(libmtd, write_start, mtd->mtd_num, eb, offs, len);
+	ret = do_writev(mtd, fd, eb, offs, iov, iovcnt, len);
+	op_stats_record(mtd->mtd_num, MTD_OP_WRITE, start);
+	PROBE(libmtd, write_done, mtd->mtd_num, eb, offs, len, ret);
+	return ret;
+}
+
 static int do_oob_op(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
 		     uint64_t start, uint64_t length, void *data,
 		     unsigned int cmd64, unsigned int cmd)
@@ -1261,24 +1769,12 @@ static int do_oob_op(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
 	oob64.length = length;
 	oob64.usr_ptr = (uint64_t)(unsigned long)data;
 
-	if (lib->offs64_ioctls == OFFS64_IOCTLS_SUPPORTED ||
-	    lib->offs64_ioctls == OFFS64_IOCTLS_UNKNOWN) {
+	if (lib->offs64_ioctls == OFFS64_IOCTLS_SUPPORTED) {
 		ret = ioctl(fd, cmd64, &oob64);
-		if (ret == 0)
-			return ret;
-
-		if (errno != ENOTTY ||
-		    lib->offs64_ioctls != OFFS64_IOCTLS_UNKNOWN) {
+		if (ret < 0)
 			sys_errmsg("%s ioctl failed for mtd%d, offset %" PRIu64 " (eraseblock %" PRIu64 ")",
 				   cmd64_str, mtd->mtd_num, start, start / mtd->eb_size);
-		}
-
-		/*
-		 * MEMREADOOB64/MEMWRITEOOB64 support was added in kernel
-		 * version 2.6.31, so probably we are working with older kernel
-		 * and these ioctls are not supported.
-		 */
-		lib->offs64_ioctls = OFFS64_IOCTLS_NOT_SUPPORTED;
+		return ret;
 	}
 
 	if (oob64.start > 0xFFFFFFFFULL) {
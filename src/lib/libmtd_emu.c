@@ -0,0 +1,263 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * This file is part of the MTD library. Implements an MTD device emulator on
+ * top of regular files, used for testing and benchmarking without real flash
+ * hardware. The emulated devices behave like NOR flash: erase sets all bits
+ * to 1 and writes may only clear bits. All the operations are delayed
+ * according to a simple timing model read from the emulator configuration
+ * file:
+ *
+ *   erase_us  N   time to erase one eraseblock
+ *   write_us  N   fixed time of one write operation
+ *   write_bps N   write (program) throughput in bytes per second
+ *   read_us   N   fixed time of one read operation
+ *   read_bps  N   read throughput in bytes per second
+ *
+ * Zero values (the default) mean no delay.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#include <libmtd.h>
+#include "libmtd_int.h"
+#include "common.h"
+
+#define EMU_CHUNK 4096
+
+/**
+ * struct emu_model - emulator timing model.
+ * @erase_us: time to erase one eraseblock in microseconds
+ * @write_us: fixed time of a write operation in microseconds
+ * @write_bps: write throughput in bytes per second
+ * @read_us: fixed time of a read operation in microseconds
+ * @read_bps: read throughput in bytes per second
+ */
+struct emu_model
+{
+	long long erase_us;
+	long long write_us;
+	long long write_bps;
+	long long read_us;
+	long long read_bps;
+};
+
+/*
+ * The data path functions take no library descriptor, so the emulator is
+ * process-wide. It is enabled while any emulator descriptor is open (@users)
+ * and the emulated and the real descriptors (@real_users) exclude each other,
+ * otherwise erases and writes meant for the real MTD devices would go to the
+ * emulator. The counters are protected by @lock, the data path only reads
+ * @enabled.
+ */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static int users;
+static int real_users;
+static int enabled;
+static struct emu_model model;
+static uint8_t erased[EMU_CHUNK];
+
+static void delay(long long us, long long bps, long long bytes)
+{
+	long long ns = us * 1000;
+	struct timespec ts;
+
+	if (bps)
+		ns += bytes * 1000000000LL / bps;
+	if (!ns)
+		return;
+
+	ts.tv_sec = ns / 1000000000LL;
+	ts.tv_nsec = ns % 1000000000LL;
+	while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+		;
+}
+
+static int read_model(const char *root, struct emu_model *model)
+{
+	char file[strlen(root) + sizeof(EMU_CONF)];
+	char line[128], key[32];
+	long long value;
+	FILE *fp;
+
+	memset(model, 0, sizeof(*model));
+
+	sprintf(file, "%s" EMU_CONF, root);
+	fp = fopen(file, "r");
+	if (!fp) {
+		if (errno != ENOENT)
+			return sys_errmsg("cannot open \"%s\"", file);
+		return 0;
+	}
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (line[0] == '#' || line[0] == '\n')
+			continue;
+		if (sscanf(line, "%31s %lld", key, &value) != 2 || value < 0) {
+			errmsg("bad line in \"%s\": %s", file, line);
+			goto out_error;
+		}
+
+		if (!strcmp(key, "erase_us"))
+			model->erase_us = value;
+		else if (!strcmp(key, "write_us"))
+			model->write_us = value;
+		else if (!strcmp(key, "write_bps"))
+			model->write_bps = value;
+		else if (!strcmp(key, "read_us"))
+			model->read_us = value;
+		else if (!strcmp(key, "read_bps"))
+			model->read_bps = value;
+		else {
+			errmsg("unknown key \"%s\" in \"%s\"", key, file);
+			goto out_error;
+		}
+	}
+
+	fclose(fp);
+	return 0;
+
+out_error:
+	fclose(fp);
+	errno = EINVAL;
+	return -1;
+}
+
+int emu_get(const char *root)
+{
+	struct emu_model new;
+	int ret = -1;
+
+	if (read_model(root, &new))
+		return -1;
+
+	pthread_mutex_lock(&lock);
+	if (real_users) {
+		errmsg("MTD devices are in use, cannot open the emulator");
+		errno = EBUSY;
+		goto out;
+	}
+	if (users && memcmp(&new, &model, sizeof(model))) {
+		errmsg("the emulator is in use with a different timing model");
+		errno = EBUSY;
+		goto out;
+	}
+
+	if (!users++) {
+		model = new;
+		memset(erased, 0xFF, sizeof(erased));
+		__atomic_store_n(&enabled, 1, __ATOMIC_RELEASE);
+	}
+	ret = 0;
+out:
+	pthread_mutex_unlock(&lock);
+	return ret;
+}
+
+void emu_put(void)
+{
+	pthread_mutex_lock(&lock);
+	if (!--users)
+		__atomic_store_n(&enabled, 0, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&lock);
+}
+
+int emu_real_get(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&lock);
+	if (users) {
+		errmsg("the MTD emulator is in use, cannot open the MTD devices");
+		errno = EBUSY;
+		ret = -1;
+	} else
+		real_users++;
+	pthread_mutex_unlock(&lock);
+
+	return ret;
+}
+
+void emu_real_put(void)
+{
+	pthread_mutex_lock(&lock);
+	real_users--;
+	pthread_mutex_unlock(&lock);
+}
+
+int emu_enabled(void)
+{
+	return __atomic_load_n(&enabled, __ATOMIC_ACQUIRE);
+}
+
+int emu_erase(const struct mtd_dev_info *mtd, int fd, off_t start, off_t len)
+{
+	off_t offs;
+	ssize_t ret;
+
+	for (offs = 0; offs < len; offs += ret) {
+		ret = pwrite(fd, erased, MIN(len - offs, EMU_CHUNK),
+			     start + offs);
+		if (ret <= 0)
+			return sys_errmsg("cannot erase mtd%d at offset %lld",
+					  mtd->mtd_num, (long long)(start + offs));
+	}
+
+	delay(model.erase_us * (len / mtd->eb_size), 0, 0);
+
+	return 0;
+}
+
+int emu_write(const struct mtd_dev_info *mtd, int fd, off_t offs,
+	      const void *data, int len)
+{
+	const uint8_t *new = data;
+	uint8_t old[EMU_CHUNK];
+	int i, pos, cnt;
+	ssize_t ret;
+
+	/* NOR flash can only clear bits, anything else needs an erase first */
+	for (pos = 0; pos < len; pos += cnt) {
+		cnt = MIN(len - pos, EMU_CHUNK);
+		ret = pread(fd, old, cnt, offs + pos);
+		if (ret != cnt)
+			return sys_errmsg("cannot read mtd%d at offset %lld",
+					  mtd->mtd_num, (long long)(offs + pos));
+		for (i = 0; i < cnt; i++) {
+			if ((old[i] & new[pos + i]) != new[pos + i]) {
+				errmsg("write to non-erased area of mtd%d at offset %lld",
+				       mtd->mtd_num, (long long)(offs + pos + i));
+				errno = EIO;
+				return -1;
+			}
+		}
+	}
+
+	ret = pwrite(fd, data, len, offs);
+	if (ret != len)
+		return sys_errmsg("cannot write %d bytes to mtd%d (offset %lld)",
+				  len, mtd->mtd_num, (long long)offs);
+
+	delay(model.write_us, model.write_bps, len);
+
+	return 0;
+}
+
+void emu_read_delay(int len)
+{
+	delay(model.read_us, model.read_bps, len);
+}
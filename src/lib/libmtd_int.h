@@ -34,6 +34,13 @@ extern "C" {
 #define SYSFS_ROOT "/sys"
 #endif
 
+#define DEV_ROOT         "/dev"
+
+/* Emulator tree layout, relative to the emulator root directory */
+#define EMU_SYSFS        "/sys"
+#define EMU_DEV          "/dev"
+#define EMU_CONF         "/emu.conf"
+
 #define SYSFS_MTD        "class/mtd"
 #define MTD_NAME_PATT    "mtd%d"
 #define MTD_DEV          "dev"
@@ -48,12 +55,16 @@ extern "C" {
 #define MTD_REGION_CNT   "numeraseregions"
 #define MTD_FLAGS        "flags"
 
-#define OFFS64_IOCTLS_UNKNOWN       0
+/* Number of paths in the descriptor arena and the longest file name */
+#define MTD_PATHS_CNT    14
+#define MTD_FILE_MAX     sizeof(MTD_REGION_CNT)
+
 #define OFFS64_IOCTLS_NOT_SUPPORTED 1
 #define OFFS64_IOCTLS_SUPPORTED     2
 
 /**
  * libmtd - MTD library description data structure.
+ * @dev_node: MTD device node pattern
  * @sysfs_mtd: MTD directory in sysfs
  * @mtd: MTD device sysfs directory pattern
  * @mtd_dev: MTD device major/minor numbers file pattern
@@ -70,20 +81,21 @@ extern "C" {
  * @sysfs_supported: non-zero if sysfs is supported by MTD
  * @offs64_ioctls: %OFFS64_IOCTLS_SUPPORTED if 64-bit %MEMERASE64,
  *                 %MEMREADOOB64, %MEMWRITEOOB64 MTD device ioctls are
- *                 supported, %OFFS64_IOCTLS_NOT_SUPPORTED if not, and
- *                 %OFFS64_IOCTLS_UNKNOWN if it is not known yet;
+ *                 supported, %OFFS64_IOCTLS_NOT_SUPPORTED if not
+ * @emu: non-zero if the descriptor was opened by 'libmtd_open_emu()'
+ * @arena_size: size of @arena
+ * @arena_used: used bytes of @arena
+ * @arena: storage of all the path strings above, allocated together with the
+ *         descriptor so that there is a single allocation per descriptor
  *
- *  Note, we cannot find out whether 64-bit ioctls are supported by MTD when we
- *  are initializing the library, because this requires an MTD device node.
- *  Indeed, we have to actually call the ioctl and check for %ENOTTY to find
- *  out whether it is supported or not.
- *
- *  Thus, we leave %offs64_ioctls uninitialized in 'libmtd_open()', and
- *  initialize it later, when corresponding libmtd function is used, and when
- *  we actually have a device node and can invoke an ioctl command on it.
+ * All the fields, including the capabilities (@sysfs_supported,
+ * @offs64_ioctls), are set in 'libmtd_open()' and never modified afterwards,
+ * so the descriptor may be used by multiple threads concurrently without any
+ * locking. The 64-bit ioctls support is probed with 'offs64_ioctls_probe()'.
  */
 struct libmtd
 {
+	char *dev_node;
 	char *sysfs_mtd;
 	char *mtd;
 	char *mtd_dev;
@@ -99,8 +111,25 @@ struct libmtd
 	char *mtd_flags;
 	unsigned int sysfs_supported:1;
 	unsigned int offs64_ioctls:2;
+	unsigned int emu:1;
+	size_t arena_size;
+	size_t arena_used;
+	char arena[];
 };
 
+int emu_get(const char *root);
+void emu_put(void);
+int emu_real_get(void);
+void emu_real_put(void);
+int emu_enabled(void);
+int emu_erase(const struct mtd_dev_info *mtd, int fd, off_t start, off_t len);
+int emu_write(const struct mtd_dev_info *mtd, int fd, off_t offs,
+	      const void *data, int len);
+void emu_read_delay(int len);
+
+uint64_t op_stats_start(void);
+void op_stats_record(int mtd_num, enum mtd_op op, uint64_t start);
+
 int legacy_procfs_is_supported(void);
 int legacy_dev_present(int mtd_num);
 int legacy_mtd_get_info(struct mtd_info *info);
@@ -52,7 +52,8 @@
  * @size: device size
  * @eb_size: eraseblock size
  * @name: device name
- * @buf: contents of /proc/mtd
+ * @buf: contents of /proc/mtd (kept in the structure, so that parsing does not
+ *       need any heap allocation)
  * @data_size: how much data was read into @buf
  * @next: next string in @buf to parse
  */
@@ -62,7 +63,7 @@ struct proc_parse_info
 	long long size;
 	char name[MTD_NAME_MAX + 1];
 	int eb_size;
-	char *buf;
+	char buf[PROC_MTD_MAX_LEN];
 	int data_size;
 	char *next;
 };
@@ -75,19 +76,17 @@ static int proc_parse_start(struct proc_parse_info *pi)
 	if (fd == -1)
 		return -1;
 
-	pi->buf = xmalloc(PROC_MTD_MAX_LEN);
-
 	ret = read(fd, pi->buf, PROC_MTD_MAX_LEN);
 	if (ret == -1) {
 		sys_errmsg("cannot read \"%s\"", MTD_PROC_FILE);
-		goto out_free;
+		goto out_close;
 	}
 
 	if (ret < PROC_MTD_FIRST_LEN ||
 	    memcmp(pi->buf, PROC_MTD_FIRST, PROC_MTD_FIRST_LEN)) {
 		errmsg("\"%s\" does not start with \"%s\"", MTD_PROC_FILE,
 		       PROC_MTD_FIRST);
-		goto out_free;
+		goto out_close;
 	}
 
 	pi->data_size = ret;
@@ -96,8 +95,7 @@ static int proc_parse_start(struct proc_parse_info *pi)
 	close(fd);
 	return 0;
 
-out_free:
-	free(pi->buf);
+out_close:
 	close(fd);
 	return -1;
 }
@@ -107,10 +105,8 @@ static int proc_parse_next(struct proc_parse_info *pi)
 	int ret, len, pos = pi->next - pi->buf;
 	char *p, *p1;
 
-	if (pos >= pi->data_size) {
-		free(pi->buf);
+	if (pos >= pi->data_size)
 		return 0;
-	}
 
 	ret = sscanf(pi->next, PROC_MTD_PATT, &pi->mtd_num, &pi->size,
 		     &pi->eb_size);
@@ -0,0 +1,154 @@
+/*
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See
+ * the GNU General Public License for more details.
+ *
+ * This file is part of the MTD library. Implements the per-device operation
+ * latency statistics. The counters are updated with relaxed atomic operations,
+ * so the statistics may be collected from multiple threads.
+ */
+
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+
+#include <libmtd.h>
+#include "libmtd_int.h"
+#include "common.h"
+
+static const char *op_names[MTD_OP_CNT] = {
+	"erase", "write", "read", "sysfs"
+};
+
+static int enabled;
+static struct mtd_op_stats stats[MTD_STATS_DEVS][MTD_OP_CNT];
+
+static uint64_t now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/**
+ * bucket - get histogram bucket of a latency.
+ * @us: latency in microseconds
+ */
+static int bucket(uint64_t us)
+{
+	int b;
+
+	if (us < 2)
+		return 0;
+	b = 63 - __builtin_clzll(us);
+	return MIN(b, MTD_HIST_BUCKETS - 1);
+}
+
+uint64_t op_stats_start(void)
+{
+	if (!__atomic_load_n(&enabled, __ATOMIC_RELAXED))
+		return 0;
+	return now_us();
+}
+
+void op_stats_record(int mtd_num, enum mtd_op op, uint64_t start)
+{
+	struct mtd_op_stats *st;
+	uint64_t us, max;
+
+	if (!start || mtd_num < 0 || mtd_num >= MTD_STATS_DEVS)
+		return;
+
+	us = now_us() - start;
+	st = &stats[mtd_num][op];
+
+	__atomic_fetch_add(&st->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->total_us, us, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&st->hist[bucket(us)], 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&st->max_us, __ATOMIC_RELAXED);
+	while (us > max && !__atomic_compare_exchange_n(&st->max_us, &max, us,
+							1, __ATOMIC_RELAXED,
+							__ATOMIC_RELAXED))
+		;
+}
+
+void mtd_stats_enable(int enable)
+{
+	__atomic_store_n(&enabled, !!enable, __ATOMIC_RELAXED);
+}
+
+int mtd_stats_get(int mtd_num, enum mtd_op op, struct mtd_op_stats *st)
+{
+	const struct mtd_op_stats *src;
+	int i;
+
+	if (mtd_num < 0 || mtd_num >= MTD_STATS_DEVS || op < 0 ||
+	    op >= MTD_OP_CNT) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	src = &stats[mtd_num][op];
+	st->count = __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	st->total_us = __atomic_load_n(&src->total_us, __ATOMIC_RELAXED);
+	st->max_us = __atomic_load_n(&src->max_us, __ATOMIC_RELAXED);
+	for (i = 0; i < MTD_HIST_BUCKETS; i++)
+		st->hist[i] = __atomic_load_n(&src->hist[i], __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+/**
+ * percentile - get the upper bound of the bucket containing a percentile.
+ * @st: operation statistics
+ * @pct: the percentile
+ */
+static uint64_t percentile(const struct mtd_op_stats *st, int pct)
+{
+	uint64_t cnt = 0, limit = (st->count * pct + 99) / 100;
+	int i;
+
+	for (i = 0; i < MTD_HIST_BUCKETS; i++) {
+		cnt += st->hist[i];
+		if (cnt >= limit)
+			break;
+	}
+	return MIN(2ULL << i, st->max_us);
+}
+
+void mtd_stats_dump(FILE *fp)
+{
+	struct mtd_op_stats st;
+	int num, op, i;
+
+	for (num = 0; num < MTD_STATS_DEVS; num++) {
+		for (op = 0; op < MTD_OP_CNT; op++) {
+			mtd_stats_get(num, op, &st);
+			if (!st.count)
+				continue;
+
+			fprintf(fp, "mtd%d %s: count %" PRIu64 ", avg %" PRIu64
+				" us, p50 <= %" PRIu64 " us, p99 <= %" PRIu64
+				" us, max %" PRIu64 " us\n", num, op_names[op],
+				st.count, st.total_us / st.count,
+				percentile(&st, 50), percentile(&st, 99),
+				st.max_us);
+			for (i = 0; i < MTD_HIST_BUCKETS; i++) {
+				if (!st.hist[i])
+					continue;
+				fprintf(fp, "  %10llu - %10llu us: %" PRIu64 "\n",
+					i ? 1ULL << i : 0, (2ULL << i) - 1,
+					st.hist[i]);
+			}
+		}
+	}
+}
@@ -0,0 +1,114 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include "libmtd.h"
+#include "card.h"
+#include "flash.h"
+#include "fwflash.h"
+
+
+struct fwflash {
+	libmtd_t desc;
+	struct registry reg;
+	int rollback;
+	/* The emulator calibration and health paths, empty for the defaults */
+	char tune_file[PATH_MAX];
+	char health_dir[PATH_MAX];
+};
+
+fwflash_t *fwflash_open(const char *emu_root)
+{
+	fwflash_t *fw;
+
+	if (!(fw = calloc(1, sizeof(*fw)))) {
+		fprintf(stderr, "Error allocating fwflash handle\n");
+		return NULL;
+	}
+
+	if (!(fw->desc = emu_root ? libmtd_open_emu(emu_root) : libmtd_open())) {
+		if (errno)
+			fprintf(stderr, "MTD: %s\n", strerror(errno));
+		else
+			fprintf(stderr, "MTD not present\n");
+		free(fw);
+		return NULL;
+	}
+	if (emu_root) {
+		snprintf(fw->tune_file, sizeof(fw->tune_file), "%s/tune", emu_root);
+		snprintf(fw->health_dir, sizeof(fw->health_dir), "%s/health",
+		  emu_root);
+	}
+
+	if (fwflash_scan(fw) < 0) {
+		fwflash_close(fw);
+		return NULL;
+	}
+
+	return fw;
+}
+
+void fwflash_close(fwflash_t *fw)
+{
+	if (!fw)
+		return;
+
+	registry_free(&fw->reg);
+	libmtd_close(fw->desc);
+	free(fw);
+}
+
+int fwflash_scan(fwflash_t *fw)
+{
+	return part_list(fw->desc, &fw->reg);
+}
+
+int fwflash_cards(fwflash_t *fw, struct fwflash_card *cards, int max)
+{
+	int i;
+
+	for (i = 0; i < fw->reg.cnt && i < max; i++) {
+		cards[i].sn = fw->reg.cards[i].sn;
+		cards[i].type = fw->reg.cards[i].type;
+		cards[i].mtd_num = fw->reg.cards[i].fw_num;
+	}
+
+	return fw->reg.cnt;
+}
+
+int fwflash_image(const void *buf, size_t len, struct fwflash_image *img)
+{
+	const char *data;
+
+	if (parse_fw("FW image", buf, len, &data, &img->size, &img->version) < 0)
+		return -1;
+	img->data = data;
+
+	return 0;
+}
+
+void fwflash_set_rollback(fwflash_t *fw, int enable)
+{
+	fw->rollback = enable;
+}
+
+int fwflash_flash(fwflash_t *fw, uint32_t sn, const struct fwflash_image *img,
+  fwflash_progress_cb cb, void *arg)
+{
+	struct flash_opts opts = {
+		.progress_fd = -1,
+		.progress_cb = cb,
+		.progress_arg = arg,
+		.rollback = fw->rollback,
+		.tune_file = fw->tune_file[0] ? fw->tune_file : NULL,
+		.health_dir = fw->health_dir[0] ? fw->health_dir : NULL
+	};
+	struct card *card;
+
+	if (!(card = part_find(&fw->reg, sn, (img->version >> 16) & 0xff)))
+		return -1;
+
+	return flash_fw(fw->desc, card->fw_num, card->sn, img->data, img->size,
+	  &opts);
+}
@@ -0,0 +1,196 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include "card.h"
+#include "stats.h"
+#include "metrics.h"
+
+
+/*
+ * Slot states, a slot is sampled only once its counters are reset. A detached
+ * slot is done until the reporter adds its counters to the retired ones and
+ * frees it, so a card is never counted both in the slot and in the totals.
+ */
+#define SLOT_FREE  0
+#define SLOT_INIT  1
+#define SLOT_READY 2
+#define SLOT_DONE  3
+
+static struct metrics_card cards[METRICS_CARDS_MAX];
+/* Counters of the detached cards, only touched by sample() */
+static uint64_t retired[METRICS_COUNTERS];
+
+static struct reporter {
+	FILE *fp;
+	unsigned interval_ms;
+	int enabled;
+	int stop;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	uint64_t last_ns;
+	uint64_t last[METRICS_COUNTERS];
+} rep = {
+	.lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static uint64_t load(const uint64_t *v)
+{
+	return __atomic_load_n(v, __ATOMIC_RELAXED);
+}
+
+/*
+ * Called by the reporter thread only (or once it is stopped). Every slot state
+ * is read once: a ready slot is counted with its current counters, a done one
+ * is retired with its final ones, so the totals never decrease.
+ */
+static void sample(int force)
+{
+	uint64_t c[METRICS_CARDS_MAX][METRICS_COUNTERS];
+	uint64_t total[METRICS_COUNTERS], bytes, now = stats_now();
+	char sn[16];
+	int i, j, active = 0, ready[METRICS_CARDS_MAX];
+
+	memset(total, 0, sizeof(total));
+	for (i = 0; i < METRICS_CARDS_MAX; i++) {
+		ready[i] = 0;
+		switch (__atomic_load_n(&cards[i].used, __ATOMIC_ACQUIRE)) {
+		case SLOT_DONE:
+			for (j = 0; j < METRICS_COUNTERS; j++)
+				retired[j] += load(&cards[i].count[j]);
+			__atomic_store_n(&cards[i].used, SLOT_FREE, __ATOMIC_RELEASE);
+			break;
+		case SLOT_READY:
+			for (j = 0; j < METRICS_COUNTERS; j++) {
+				c[i][j] = load(&cards[i].count[j]);
+				total[j] += c[i][j];
+			}
+			ready[i] = 1;
+			active++;
+			break;
+		}
+	}
+	for (j = 0; j < METRICS_COUNTERS; j++)
+		total[j] += retired[j];
+
+	if (!force && !active && !memcmp(total, rep.last, sizeof(total)))
+		return;
+
+	for (i = 0; i < METRICS_CARDS_MAX; i++) {
+		if (!ready[i])
+			continue;
+		sn2str(cards[i].sn, sn, sizeof(sn));
+		fprintf(rep.fp, "  %s mtd%d: erased %" PRIu64 ", written %" PRIu64
+		  ", verified %" PRIu64 " blocks, %" PRIu64 " bytes\n", sn,
+		  cards[i].num, c[i][METRICS_ERASED], c[i][METRICS_WRITTEN],
+		  c[i][METRICS_VERIFIED], c[i][METRICS_BYTES]);
+	}
+	bytes = total[METRICS_BYTES] > rep.last[METRICS_BYTES]
+	  ? total[METRICS_BYTES] - rep.last[METRICS_BYTES] : 0;
+	fprintf(rep.fp, "metrics: %d cards, erased %" PRIu64 ", written %" PRIu64
+	  ", verified %" PRIu64 " blocks, %" PRIu64 " bytes, %.2f MB/s, %" PRIu64
+	  " errors\n", active, total[METRICS_ERASED], total[METRICS_WRITTEN],
+	  total[METRICS_VERIFIED], total[METRICS_BYTES],
+	  stats_mbps(bytes, now - rep.last_ns), total[METRICS_ERRORS]);
+	fflush(rep.fp);
+
+	memcpy(rep.last, total, sizeof(total));
+	rep.last_ns = now;
+}
+
+static void *reporter(void *arg)
+{
+	struct timespec ts;
+
+	pthread_mutex_lock(&rep.lock);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	while (!rep.stop) {
+		ts.tv_sec += rep.interval_ms / 1000;
+		ts.tv_nsec += (rep.interval_ms % 1000) * 1000000L;
+		if (ts.tv_nsec >= 1000000000L) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000L;
+		}
+		if (pthread_cond_timedwait(&rep.cond, &rep.lock, &ts) == ETIMEDOUT)
+			sample(0);
+	}
+	pthread_mutex_unlock(&rep.lock);
+
+	return NULL;
+}
+
+int metrics_start(FILE *fp, unsigned interval_ms)
+{
+	pthread_condattr_t attr;
+
+	if (rep.enabled)
+		return 0;
+
+	rep.fp = fp;
+	rep.interval_ms = interval_ms ? interval_ms : 1;
+	rep.stop = 0;
+	rep.last_ns = stats_now();
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&rep.cond, &attr);
+	pthread_condattr_destroy(&attr);
+
+	__atomic_store_n(&rep.enabled, 1, __ATOMIC_RELEASE);
+	if ((errno = pthread_create(&rep.thread, NULL, reporter, NULL))) {
+		__atomic_store_n(&rep.enabled, 0, __ATOMIC_RELEASE);
+		pthread_cond_destroy(&rep.cond);
+		return -1;
+	}
+
+	return 0;
+}
+
+void metrics_stop(void)
+{
+	if (!rep.enabled)
+		return;
+
+	pthread_mutex_lock(&rep.lock);
+	rep.stop = 1;
+	pthread_cond_signal(&rep.cond);
+	pthread_mutex_unlock(&rep.lock);
+	pthread_join(rep.thread, NULL);
+	pthread_cond_destroy(&rep.cond);
+
+	__atomic_store_n(&rep.enabled, 0, __ATOMIC_RELEASE);
+	sample(1);
+}
+
+struct metrics_card *metrics_attach(uint32_t sn, int num)
+{
+	struct metrics_card *m;
+	int i, state;
+
+	if (!__atomic_load_n(&rep.enabled, __ATOMIC_ACQUIRE))
+		return NULL;
+
+	for (i = 0; i < METRICS_CARDS_MAX; i++) {
+		m = &cards[i];
+		state = SLOT_FREE;
+		if (!__atomic_compare_exchange_n(&m->used, &state, SLOT_INIT, 0,
+		  __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+			continue;
+		memset(m->count, 0, sizeof(m->count));
+		m->sn = sn;
+		m->num = num;
+		__atomic_store_n(&m->used, SLOT_READY, __ATOMIC_RELEASE);
+		return m;
+	}
+
+	return NULL;
+}
+
+void metrics_detach(struct metrics_card *m)
+{
+	if (m)
+		__atomic_store_n(&m->used, SLOT_DONE, __ATOMIC_RELEASE);
+}
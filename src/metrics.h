@@ -0,0 +1,55 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+#define METRICS_CARDS_MAX 64
+#define METRICS_CACHELINE 64
+
+enum metrics_counter {
+	METRICS_ERASED,		/* eraseblocks */
+	METRICS_WRITTEN,
+	METRICS_VERIFIED,
+	METRICS_BYTES,		/* bytes written */
+	METRICS_ERRORS,		/* failed flashes */
+	METRICS_COUNTERS
+};
+
+/*
+ * Live counters of a card being flashed. Each card has its own cache line
+ * aligned slot, so the flashing workers never share a cache line and update
+ * their counters wait-free (relaxed atomic adds, no locks). A reporter thread
+ * samples all the slots every interval and prints the per-card and the total
+ * counters and throughput. The samples are not a consistent snapshot of all
+ * the counters, but every card is counted exactly once and the totals never
+ * decrease.
+ */
+struct metrics_card {
+	uint64_t count[METRICS_COUNTERS];
+	uint32_t sn;
+	int num;
+	int used;
+} __attribute__((aligned(METRICS_CACHELINE)));
+
+/*
+ * Starts the reporter thread printing to fp every interval_ms milliseconds.
+ * Until then, metrics_attach() returns NULL and nothing is counted.
+ */
+extern int metrics_start(FILE *fp, unsigned interval_ms);
+/* Stops the reporter thread and prints the final sample */
+extern void metrics_stop(void);
+
+/* Returns a free card slot or NULL if none is free or metrics are off */
+extern struct metrics_card *metrics_attach(uint32_t sn, int num);
+/* Ends the counting, the reporter adds the slot to the totals and frees it */
+extern void metrics_detach(struct metrics_card *m);
+
+static inline void metrics_add(struct metrics_card *m,
+  enum metrics_counter counter, uint64_t n)
+{
+	if (m)
+		__atomic_fetch_add(&m->count[counter], n, __ATOMIC_RELAXED);
+}
+
+#endif /* METRICS_H */
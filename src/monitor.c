@@ -0,0 +1,200 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <linux/netlink.h>
+#include "card.h"
+#include "cache.h"
+#include "monitor.h"
+
+
+#define UEVENT_BUFFER_SIZE 8192
+#define UEVENT_SUBSYSTEM   "mtd"
+
+enum action {
+	ACTION_ADD,
+	ACTION_REMOVE
+};
+
+static int netlink_open()
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	if ((fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC,
+	  NETLINK_KOBJECT_UEVENT)) < 0) {
+		fprintf(stderr, "Error opening uevent socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = 1;
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "Error binding uevent socket: %s\n", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+/*
+ * Synthetic uevents (in the kernel format) can be injected through a Unix
+ * datagram socket instead of the netlink socket for testing.
+ */
+static int unix_open(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return -1;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+		fprintf(stderr, "Error opening uevent socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	unlink(path);
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+static int uevent_parse(const char *buf, size_t len, enum action *action,
+  int *num)
+{
+	const char *p, *act = NULL, *subsystem = NULL, *devname = NULL;
+	char c;
+
+	for (p = buf; p < buf + len; p += strlen(p) + 1) {
+		if (!strncmp(p, "ACTION=", 7))
+			act = p + 7;
+		else if (!strncmp(p, "SUBSYSTEM=", 10))
+			subsystem = p + 10;
+		else if (!strncmp(p, "DEVNAME=", 8))
+			devname = p + 8;
+	}
+
+	if (!act || !subsystem || !devname || strcmp(subsystem, UEVENT_SUBSYSTEM))
+		return -1;
+	/* Skip the read-only mtdXro devices */
+	if (sscanf(devname, "mtd%d%c", num, &c) != 1)
+		return -1;
+
+	if (!strcmp(act, "add"))
+		*action = ACTION_ADD;
+	else if (!strcmp(act, "remove"))
+		*action = ACTION_REMOVE;
+	else
+		return -1;
+
+	return 0;
+}
+
+static int publish(libmtd_t desc, const struct registry *reg)
+{
+	if (cache_update(desc, reg) < 0) {
+		fprintf(stderr, "Error writing %s\n", CACHE_FILE);
+		return -1;
+	}
+
+	return 0;
+}
+
+int uevent_open(const char *path)
+{
+	return path ? unix_open(path) : netlink_open();
+}
+
+void uevent_close(int fd, const char *path)
+{
+	close(fd);
+	if (path)
+		unlink(path);
+}
+
+int uevent_rescan(libmtd_t desc, struct registry *reg)
+{
+	return part_list(desc, reg);
+}
+
+int uevent_handle(int fd, libmtd_t desc, struct registry *reg)
+{
+	struct sockaddr_storage addr;
+	socklen_t addrlen = sizeof(addr);
+	char buf[UEVENT_BUFFER_SIZE];
+	enum action action;
+	ssize_t len;
+	int num;
+
+	len = recvfrom(fd, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&addr,
+	  &addrlen);
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		if (errno == ENOBUFS) {
+			/* Events were lost, the inventory must be rebuilt */
+			if (uevent_rescan(desc, reg) < 0)
+				return -1;
+			return 1;
+		}
+		fprintf(stderr, "Error receiving uevent: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* Only accept netlink messages sent by the kernel */
+	if (addr.ss_family == AF_NETLINK && ((struct sockaddr_nl *)&addr)->nl_pid)
+		return 0;
+
+	buf[len] = '\0';
+	if (uevent_parse(buf, len, &action, &num) < 0)
+		return 0;
+
+	/* A card that failed to probe is not fatal for the monitoring */
+	if (action == ACTION_ADD)
+		card_add(desc, reg, num);
+	else
+		card_remove(reg, num);
+
+	/*
+	 * Every MTD device change invalidates the cache signature, even if no
+	 * card has changed (the other partition of a card, non-card devices)
+	 */
+	return 1;
+}
+
+int monitor(libmtd_t desc, const char *path)
+{
+	struct registry reg = REGISTRY_INIT;
+	int fd, ret;
+
+	/* Open the socket first to not miss events during the initial scan */
+	if ((fd = uevent_open(path)) < 0)
+		return -1;
+	if (uevent_rescan(desc, &reg) < 0 || publish(desc, &reg) < 0)
+		goto error;
+
+	while ((ret = uevent_handle(fd, desc, &reg)) >= 0)
+		if (ret > 0)
+			publish(desc, &reg);
+
+error:
+	registry_free(&reg);
+	uevent_close(fd, path);
+
+	return -1;
+}
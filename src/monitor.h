@@ -0,0 +1,21 @@
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#include "libmtd.h"
+#include "card.h"
+
+/*
+ * MTD hotplug uevent source, the kernel netlink socket or (for testing) the
+ * Unix datagram socket path if not NULL. uevent_handle() receives a single
+ * uevent from fd and applies it to the card registry. It returns 1 for an MTD
+ * device add/remove uevent (the cache must be republished), 0 for any other
+ * uevent and -1 on error.
+ */
+extern int uevent_open(const char *path);
+extern void uevent_close(int fd, const char *path);
+extern int uevent_handle(int fd, libmtd_t desc, struct registry *reg);
+extern int uevent_rescan(libmtd_t desc, struct registry *reg);
+
+extern int monitor(libmtd_t desc, const char *path);
+
+#endif /* MONITOR_H */
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "card.h"
+#include "stats.h"
+#include "progress.h"
+
+
+static const char *phase_names[PROGRESS_PHASES] = {
+	"erase", "write", "verify"
+};
+
+static void emit(struct progress *p, const char *buf, int len)
+{
+	/* A broken progress channel must not break the flashing itself */
+	if (len > 0 && write(p->fd, buf, len) < 0)
+		p->fd = -1;
+}
+
+static void report(struct progress *p, uint64_t now)
+{
+	char buf[512], sn[16];
+	uint64_t elapsed = now - p->phase_ns;
+	struct fwflash_progress r = {
+		.sn = p->sn,
+		.mtd_num = p->num,
+		.phase = (enum fwflash_phase)p->phase,
+		.blocks = p->blocks,
+		.blocks_total = p->blocks_total,
+		.bytes = p->bytes,
+		.bytes_total = p->bytes_total,
+		.mbps = stats_mbps(p->bytes - p->last_bytes, now - p->last_ns),
+		.avg_mbps = stats_mbps(p->bytes, elapsed),
+		.elapsed_s = (now - p->start_ns) / 1e9
+	};
+
+	r.eta_s = r.avg_mbps > 0
+	  ? (p->bytes_total - p->bytes) / (r.avg_mbps * 1e6) : -1;
+
+	if (p->cb)
+		p->cb(&r, p->arg);
+	if (p->fd >= 0) {
+		sn2str(p->sn, sn, sizeof(sn));
+		emit(p, buf, snprintf(buf, sizeof(buf), "{\"card\":\"%s\",\"mtd\":%d,"
+		  "\"phase\":\"%s\",\"blocks\":%d,\"blocks_total\":%d,\"bytes\":%llu,"
+		  "\"bytes_total\":%llu,\"mbps\":%.3f,\"avg_mbps\":%.3f,"
+		  "\"eta_s\":%.3f,\"elapsed_s\":%.3f}\n", sn, p->num,
+		  phase_names[p->phase], p->blocks, p->blocks_total,
+		  (unsigned long long)p->bytes, (unsigned long long)p->bytes_total,
+		  r.mbps, r.avg_mbps, r.eta_s, r.elapsed_s));
+	}
+
+	p->last_ns = now;
+	p->last_bytes = p->bytes;
+}
+
+void progress_init(struct progress *p, int fd, fwflash_progress_cb cb,
+  void *arg, uint32_t sn, int num)
+{
+	memset(p, 0, sizeof(*p));
+	p->fd = fd;
+	p->cb = cb;
+	p->arg = arg;
+	p->sn = sn;
+	p->num = num;
+	p->start_ns = stats_now();
+	p->metrics = metrics_attach(sn, num);
+}
+
+void progress_phase(struct progress *p, enum progress_phase phase,
+  int blocks_total, uint64_t bytes_total)
+{
+	p->phase = phase;
+	if (!progress_enabled(p))
+		return;
+
+	p->blocks = 0;
+	p->blocks_total = blocks_total;
+	p->bytes = 0;
+	p->bytes_total = bytes_total;
+	p->phase_ns = p->last_ns = stats_now();
+	p->last_bytes = 0;
+}
+
+void progress_update(struct progress *p, int blocks, uint64_t bytes)
+{
+	static const enum metrics_counter counters[PROGRESS_PHASES] = {
+		METRICS_ERASED, METRICS_WRITTEN, METRICS_VERIFIED
+	};
+	uint64_t now;
+
+	if (p->metrics) {
+		metrics_add(p->metrics, counters[p->phase], blocks);
+		if (p->phase == PROGRESS_WRITE)
+			metrics_add(p->metrics, METRICS_BYTES, bytes);
+	}
+	if (!progress_enabled(p))
+		return;
+
+	p->blocks += blocks;
+	p->bytes += bytes;
+
+	now = stats_now();
+	if (now - p->last_ns >= PROGRESS_INTERVAL_NS
+	  || p->blocks >= p->blocks_total)
+		report(p, now);
+}
+
+void progress_done(struct progress *p, int result)
+{
+	char buf[128], sn[16];
+	struct fwflash_progress r = {
+		.sn = p->sn,
+		.mtd_num = p->num,
+		.phase = FWFLASH_DONE,
+		.elapsed_s = (stats_now() - p->start_ns) / 1e9,
+		.result = result
+	};
+
+	if (result < 0)
+		metrics_add(p->metrics, METRICS_ERRORS, 1);
+	metrics_detach(p->metrics);
+	p->metrics = NULL;
+
+	if (p->cb)
+		p->cb(&r, p->arg);
+	if (p->fd >= 0) {
+		sn2str(p->sn, sn, sizeof(sn));
+		emit(p, buf, snprintf(buf, sizeof(buf), "{\"card\":\"%s\",\"mtd\":%d,"
+		  "\"phase\":\"done\",\"result\":%d,\"elapsed_s\":%.3f}\n", sn,
+		  p->num, result, r.elapsed_s));
+	}
+}
@@ -0,0 +1,56 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <stdint.h>
+#include "fwflash.h"
+#include "metrics.h"
+
+enum progress_phase {
+	PROGRESS_ERASE = FWFLASH_ERASE,
+	PROGRESS_WRITE = FWFLASH_WRITE,
+	PROGRESS_VERIFY = FWFLASH_VERIFY,
+	PROGRESS_PHASES
+};
+
+/*
+ * Flash progress of a single card, reported as newline-delimited JSON records
+ * to a file descriptor and/or to a callback (libfwflash). Every record is
+ * written with a single write(2), so multiple cards may report to the same fd
+ * concurrently. Updates are rate limited to one record per
+ * PROGRESS_INTERVAL_NS (plus the final record of each phase), so
+ * progress_update() can be called for every eraseblock. The blocks and bytes
+ * are also counted in the card metrics (see metrics.h) if enabled.
+ */
+struct progress {
+	int fd;
+	fwflash_progress_cb cb;
+	void *arg;
+	uint32_t sn;
+	int num;
+	enum progress_phase phase;
+	int blocks;
+	int blocks_total;
+	uint64_t bytes;
+	uint64_t bytes_total;
+	uint64_t start_ns;
+	uint64_t phase_ns;
+	uint64_t last_ns;
+	uint64_t last_bytes;
+	struct metrics_card *metrics;
+};
+
+#define PROGRESS_INTERVAL_NS 100000000ULL
+
+extern void progress_init(struct progress *p, int fd, fwflash_progress_cb cb,
+  void *arg, uint32_t sn, int num);
+extern void progress_phase(struct progress *p, enum progress_phase phase,
+  int blocks_total, uint64_t bytes_total);
+extern void progress_update(struct progress *p, int blocks, uint64_t bytes);
+extern void progress_done(struct progress *p, int result);
+
+static inline int progress_enabled(const struct progress *p)
+{
+	return p->fd >= 0 || p->cb;
+}
+
+#endif /* PROGRESS_H */
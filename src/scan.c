@@ -0,0 +1,315 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "stats.h"
+#include "scan.h"
+
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+enum stage {
+	STAGE_ERASE,
+	STAGE_WRITE,
+	STAGE_VERIFY,
+	STAGES
+};
+
+/* The same patterns as mtd_torture(), the last cycle restores the content */
+static const uint8_t patterns[] = {0xa5, 0x5a, 0x00};
+#define PATTERNS ((int)ARRAY_SIZE(patterns))
+#define CYCLES (PATTERNS + 1)
+
+struct block {
+	uint64_t ns[STAGES];
+	int cnt[STAGES];
+	int failed;
+	char error[64];
+};
+
+/*
+ * The work items are the (cycle, block) pairs in the order item = cycle * cnt
+ * + block. Every stage processes the items in order once the previous stage
+ * is done with them, the erase stage also waits for the previous cycle of the
+ * block to be verified. done[] counts the items each stage has finished,
+ * abort stops all the stages.
+ */
+struct scan {
+	libmtd_t desc;
+	const struct mtd_dev_info *mtd;
+	int fd;
+	int first;
+	int cnt;
+	char *orig;
+	char *patt[PATTERNS];
+	struct block *blocks;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int done[STAGES];
+	int abort;
+};
+
+struct worker {
+	struct scan *s;
+	enum stage stage;
+	char *buf;
+	pthread_t thread;
+};
+
+static void __attribute__((format(printf, 2, 3)))
+block_fail(struct block *b, const char *fmt, ...)
+{
+	va_list ap;
+
+	b->failed = 1;
+	va_start(ap, fmt);
+	vsnprintf(b->error, sizeof(b->error), fmt, ap);
+	va_end(ap);
+}
+
+static void do_erase(struct scan *s, int i)
+{
+	struct block *b = &s->blocks[i];
+	uint64_t start = stats_now();
+
+	if (mtd_erase(s->desc, s->mtd, s->fd, s->first + i) < 0) {
+		block_fail(b, "erase error");
+		return;
+	}
+	b->ns[STAGE_ERASE] += stats_now() - start;
+	b->cnt[STAGE_ERASE]++;
+}
+
+static void do_write(struct scan *s, int i, int cycle, char *buf)
+{
+	struct block *b = &s->blocks[i];
+	int offs, eb_size = s->mtd->eb_size;
+	uint64_t start;
+	char *data;
+
+	if (mtd_read(s->mtd, s->fd, s->first + i, 0, buf, eb_size) < 0) {
+		block_fail(b, "read error");
+		return;
+	}
+	if ((offs = mtd_check_pattern(buf, 0xff, eb_size)) >= 0) {
+		block_fail(b, "not erased at offset %d", offs);
+		return;
+	}
+
+	data = cycle < PATTERNS ? s->patt[cycle]
+	  : s->orig + (size_t)i * eb_size;
+	start = stats_now();
+	if (mtd_write(s->desc, s->mtd, s->fd, s->first + i, 0, data, eb_size,
+	  NULL, 0, 0) < 0) {
+		block_fail(b, "write error");
+		return;
+	}
+	b->ns[STAGE_WRITE] += stats_now() - start;
+	b->cnt[STAGE_WRITE]++;
+}
+
+static void do_verify(struct scan *s, int i, int cycle, char *buf)
+{
+	struct block *b = &s->blocks[i];
+	int offs, eb_size = s->mtd->eb_size;
+	uint64_t start = stats_now();
+
+	if (mtd_read(s->mtd, s->fd, s->first + i, 0, buf, eb_size) < 0) {
+		block_fail(b, "read error");
+		return;
+	}
+	b->ns[STAGE_VERIFY] += stats_now() - start;
+	b->cnt[STAGE_VERIFY]++;
+
+	if (cycle < PATTERNS) {
+		if ((offs = mtd_check_pattern(buf, patterns[cycle], eb_size)) >= 0)
+			block_fail(b, "pattern %02x mismatch at offset %d",
+			  patterns[cycle], offs);
+	} else if (memcmp(buf, s->orig + (size_t)i * eb_size, eb_size))
+		block_fail(b, "content not restored");
+}
+
+static int ready(const struct scan *s, enum stage stage, int item)
+{
+	if (s->abort)
+		return 1;
+	if (stage != STAGE_ERASE)
+		return s->done[stage - 1] > item;
+
+	return item < s->cnt || s->done[STAGE_VERIFY] > item - s->cnt;
+}
+
+static void *worker(void *arg)
+{
+	struct worker *w = arg;
+	struct scan *s = w->s;
+	int item, i, cycle, abort;
+
+	for (item = 0; item < CYCLES * s->cnt; item++) {
+		pthread_mutex_lock(&s->lock);
+		while (!ready(s, w->stage, item))
+			pthread_cond_wait(&s->cond, &s->lock);
+		abort = s->abort;
+		pthread_mutex_unlock(&s->lock);
+		if (abort)
+			break;
+
+		/* A failed block is skipped from then on */
+		cycle = item / s->cnt;
+		i = item % s->cnt;
+		if (!s->blocks[i].failed) {
+			if (w->stage == STAGE_ERASE)
+				do_erase(s, i);
+			else if (w->stage == STAGE_WRITE)
+				do_write(s, i, cycle, w->buf);
+			else
+				do_verify(s, i, cycle, w->buf);
+		}
+
+		pthread_mutex_lock(&s->lock);
+		s->done[w->stage] = item + 1;
+		pthread_cond_broadcast(&s->cond);
+		pthread_mutex_unlock(&s->lock);
+	}
+
+	return NULL;
+}
+
+/* The mean time of the block operation over the cycles */
+static double ms(uint64_t ns, int cnt)
+{
+	return cnt ? ns / 1e6 / cnt : 0;
+}
+
+static int report(FILE *fp, const struct scan *s, int type, uint64_t ns)
+{
+	const struct block *b;
+	int i, failed = 0;
+	uint64_t bytes = 0;
+
+	fprintf(fp, "mtd%d (%s) blocks %d-%d\n", s->mtd->mtd_num,
+	  type == 2 ? "T200" : "T100", s->first, s->first + s->cnt - 1);
+	fprintf(fp, "%-6s %11s %11s %11s  %s\n", "block", "erase [ms]",
+	  "write [ms]", "read [ms]", "result");
+	for (i = 0; i < s->cnt; i++) {
+		b = &s->blocks[i];
+		fprintf(fp, "%-6d %11.2f %11.2f %11.2f  %s\n", s->first + i,
+		  ms(b->ns[STAGE_ERASE], b->cnt[STAGE_ERASE]),
+		  ms(b->ns[STAGE_WRITE], b->cnt[STAGE_WRITE]),
+		  ms(b->ns[STAGE_VERIFY], b->cnt[STAGE_VERIFY]),
+		  b->failed ? b->error : "ok");
+		failed += b->failed;
+		bytes += (uint64_t)b->cnt[STAGE_WRITE] * s->mtd->eb_size;
+	}
+	fprintf(fp, "result: %d blocks passed, %d failed in %.2f s (%.2f MB/s "
+	  "written)\n", s->cnt - failed, failed, ns / 1e9,
+	  stats_mbps(bytes, ns));
+
+	if (failed)
+		fprintf(stderr, "The content of the failed blocks is lost, flash the "
+		  "card FW again\n");
+
+	return failed ? 1 : 0;
+}
+
+int scan(libmtd_t desc, int partition, int type, int first, int last,
+  FILE *fp)
+{
+	struct mtd_dev_info mtd;
+	struct worker workers[STAGES];
+	struct scan s = {
+		.desc = desc,
+		.mtd = &mtd,
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER
+	};
+	char mtddev[PATH_MAX];
+	int i, started = 0, ret = -1;
+	uint64_t start;
+
+	memset(workers, 0, sizeof(workers));
+
+	if (mtd_dev_node(desc, partition, mtddev, sizeof(mtddev)) < 0) {
+		fprintf(stderr, "MTD device #%d: %s\n", partition, strerror(errno));
+		return -1;
+	}
+	if (mtd_get_dev_info1(desc, partition, &mtd) < 0) {
+		fprintf(stderr, "Error getting MTD device #%d info\n", partition);
+		return -1;
+	}
+	if (last < 0)
+		last = mtd.eb_cnt - 1;
+	if (first < 0 || first > last || last >= mtd.eb_cnt) {
+		fprintf(stderr, "%d-%d: invalid block range (mtd%d has %d blocks)\n",
+		  first, last, partition, mtd.eb_cnt);
+		return -1;
+	}
+	s.first = first;
+	s.cnt = last - first + 1;
+	if ((s.fd = open(mtddev, O_RDWR)) < 0) {
+		fprintf(stderr, "Error opening %s: %s\n", mtddev, strerror(errno));
+		return -1;
+	}
+
+	if (!(s.orig = malloc((size_t)s.cnt * mtd.eb_size))
+	  || !(s.blocks = calloc(s.cnt, sizeof(*s.blocks))))
+		goto error_alloc;
+	for (i = 0; i < PATTERNS; i++) {
+		if (!(s.patt[i] = malloc(mtd.eb_size)))
+			goto error_alloc;
+		memset(s.patt[i], patterns[i], mtd.eb_size);
+	}
+	for (i = STAGE_WRITE; i < STAGES; i++)
+		if (!(workers[i].buf = malloc(mtd.eb_size)))
+			goto error_alloc;
+
+	/* One (multi-block) read of the content restored by the last cycle */
+	start = stats_now();
+	if (mtd_read_multi(&mtd, s.fd, first, 0, s.orig, s.cnt * mtd.eb_size)
+	  < 0) {
+		fprintf(stderr, "Error reading blocks %d-%d of mtd%d\n", first, last,
+		  partition);
+		goto out;
+	}
+
+	for (i = 0; i < STAGES; i++) {
+		workers[i].s = &s;
+		workers[i].stage = i;
+		if ((errno = pthread_create(&workers[i].thread, NULL, worker,
+		  &workers[i]))) {
+			fprintf(stderr, "Error starting scan thread: %s\n",
+			  strerror(errno));
+			pthread_mutex_lock(&s.lock);
+			s.abort = 1;
+			pthread_cond_broadcast(&s.cond);
+			pthread_mutex_unlock(&s.lock);
+			break;
+		}
+		started++;
+	}
+	for (i = 0; i < started; i++)
+		pthread_join(workers[i].thread, NULL);
+	if (started < STAGES)
+		goto out;
+
+	ret = report(fp, &s, type, stats_now() - start);
+	goto out;
+
+error_alloc:
+	fprintf(stderr, "Error allocating scan memory\n");
+out:
+	for (i = 0; i < STAGES; i++)
+		free(workers[i].buf);
+	for (i = 0; i < PATTERNS; i++)
+		free(s.patt[i]);
+	free(s.blocks);
+	free(s.orig);
+	close(s.fd);
+
+	return ret;
+}
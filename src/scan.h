@@ -0,0 +1,20 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#include <stdio.h>
+#include "libmtd.h"
+
+/*
+ * Acceptance scan of the eraseblocks first..last of the MTD device partition.
+ * Every block is tortured (erased, checked to be erased, written with a test
+ * pattern and verified, once per pattern) and finally rewritten with its
+ * original content, so the card FW stays intact unless a block fails or the
+ * scan is interrupted. The erase, write and verify stages run in their own
+ * threads, each on a different block. Prints the per-block results and
+ * timings to fp and returns 0 if all the blocks passed, 1 if any failed and
+ * -1 on error.
+ */
+extern int scan(libmtd_t desc, int partition, int type, int first, int last,
+  FILE *fp);
+
+#endif /* SCAN_H */
@@ -0,0 +1,277 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "stats.h"
+#include "selftest.h"
+
+
+enum test {
+	TEST_READ,
+	TEST_ERASE,
+	TEST_WRITE,
+	TESTS
+};
+
+static const char *test_names[TESTS] = {
+	"read", "erase", "write"
+};
+
+struct result {
+	uint32_t *us;
+	int cnt;
+	uint64_t bytes;
+	uint64_t ns;
+};
+
+const char *baseline_file = BASELINE_FILE;
+
+static void result_add(struct result *r, uint64_t start, uint64_t bytes)
+{
+	uint64_t ns = stats_now() - start;
+
+	r->us[r->cnt++] = ns / 1000;
+	r->bytes += bytes;
+	r->ns += ns;
+}
+
+static int baseline_load(int type, double baseline[TESTS])
+{
+	char line[128], name[16];
+	double val;
+	int t, i;
+	FILE *fp;
+
+	for (i = 0; i < TESTS; i++)
+		baseline[i] = 0;
+	if (!(fp = fopen(baseline_file, "r")))
+		return -1;
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%d %15s %lf", &t, name, &val) != 3 || t != type)
+			continue;
+		for (i = 0; i < TESTS; i++)
+			if (!strcmp(name, test_names[i]))
+				baseline[i] = val;
+	}
+	fclose(fp);
+
+	return 0;
+}
+
+static int baseline_store(int type, const struct result *res)
+{
+	char tmp[PATH_MAX], line[128], name[16];
+	double val;
+	int t, i, fd;
+	FILE *in, *out;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", baseline_file)
+	  >= sizeof(tmp))
+		return -1;
+	if (mkparent(baseline_file) < 0)
+		return -1;
+	if ((fd = mkstemp(tmp)) < 0)
+		return -1;
+	if (fchmod(fd, 0644) < 0 || !(out = fdopen(fd, "w"))) {
+		close(fd);
+		goto error;
+	}
+
+	/* Keep the other card types and the tests not run this time */
+	if ((in = fopen(baseline_file, "r"))) {
+		while (fgets(line, sizeof(line), in)) {
+			if (sscanf(line, "%d %15s %lf", &t, name, &val) != 3)
+				continue;
+			for (i = 0; i < TESTS; i++)
+				if (t == type && res[i].cnt && !strcmp(name, test_names[i]))
+					break;
+			if (i == TESTS)
+				fputs(line, out);
+		}
+		fclose(in);
+	}
+	for (i = 0; i < TESTS; i++)
+		if (res[i].cnt)
+			fprintf(out, "%d %s %.3f\n", type, test_names[i],
+			  stats_mbps(res[i].bytes, res[i].ns));
+
+	if (fclose(out))
+		goto error;
+	if (rename(tmp, baseline_file) < 0)
+		goto error;
+
+	return 0;
+
+error:
+	unlink(tmp);
+
+	return -1;
+}
+
+static int test_read(const struct mtd_dev_info *mtd, int fd, char *buf,
+  struct result *r)
+{
+	uint64_t start;
+	int eb;
+
+	for (eb = 0; eb < mtd->eb_cnt; eb++) {
+		start = stats_now();
+		if (mtd_read(mtd, fd, eb, 0, buf, mtd->eb_size) < 0) {
+			fprintf(stderr, "Error reading block #%d of mtd%d\n", eb,
+			  mtd->mtd_num);
+			return -1;
+		}
+		result_add(r, start, mtd->eb_size);
+	}
+
+	return 0;
+}
+
+/*
+ * Every block is read, erased and written back with its own content, which
+ * is then verified.
+ */
+static int test_write(libmtd_t desc, const struct mtd_dev_info *mtd, int fd,
+  const struct selftest_opts *opts, char *buf, char *check, struct result *res)
+{
+	uint64_t start;
+	int eb;
+
+	for (eb = opts->first; eb <= opts->last; eb++) {
+		if (mtd_read(mtd, fd, eb, 0, buf, mtd->eb_size) < 0)
+			goto error_read;
+
+		start = stats_now();
+		if (mtd_erase(desc, mtd, fd, eb) < 0) {
+			fprintf(stderr, "Error erasing block #%d of mtd%d\n", eb,
+			  mtd->mtd_num);
+			return -1;
+		}
+		result_add(&res[TEST_ERASE], start, mtd->eb_size);
+
+		start = stats_now();
+		if (mtd_write(desc, mtd, fd, eb, 0, buf, mtd->eb_size, NULL, 0, 0)
+		  < 0) {
+			fprintf(stderr, "Error writing block #%d of mtd%d\n", eb,
+			  mtd->mtd_num);
+			return -1;
+		}
+		result_add(&res[TEST_WRITE], start, mtd->eb_size);
+
+		if (mtd_read(mtd, fd, eb, 0, check, mtd->eb_size) < 0)
+			goto error_read;
+		if (memcmp(buf, check, mtd->eb_size)) {
+			fprintf(stderr, "Block #%d of mtd%d verification failed\n", eb,
+			  mtd->mtd_num);
+			return -1;
+		}
+	}
+
+	return 0;
+
+error_read:
+	fprintf(stderr, "Error reading block #%d of mtd%d\n", eb, mtd->mtd_num);
+
+	return -1;
+}
+
+static int report(FILE *fp, int type, struct result *res)
+{
+	double baseline[TESTS], rate;
+	int i, slow = 0;
+
+	baseline_load(type, baseline);
+
+	fprintf(fp, "%-6s %7s %10s %10s %10s %10s %10s %16s\n", "test", "blocks",
+	  "MB/s", "p50 [ms]", "p90 [ms]", "p99 [ms]", "max [ms]", "baseline MB/s");
+	for (i = 0; i < TESTS; i++) {
+		if (!res[i].cnt)
+			continue;
+		stats_sort(res[i].us, res[i].cnt);
+		rate = stats_mbps(res[i].bytes, res[i].ns);
+		fprintf(fp, "%-6s %7d %10.2f %10.2f %10.2f %10.2f %10.2f", test_names[i],
+		  res[i].cnt, rate, stats_pct(res[i].us, res[i].cnt, 50) / 1e3,
+		  stats_pct(res[i].us, res[i].cnt, 90) / 1e3,
+		  stats_pct(res[i].us, res[i].cnt, 99) / 1e3,
+		  res[i].us[res[i].cnt - 1] / 1e3);
+		if (baseline[i] > 0) {
+			fprintf(fp, " %8.2f (%3.0f%%)\n", baseline[i],
+			  rate * 100 / baseline[i]);
+			if (rate < SELFTEST_MIN_RATIO * baseline[i])
+				slow = 1;
+		} else
+			fprintf(fp, " %16s\n", "-");
+	}
+	fprintf(fp, "result: %s\n", slow ? "SLOW" : "PASS");
+
+	return slow;
+}
+
+int selftest(libmtd_t desc, int partition, int type,
+  const struct selftest_opts *opts, FILE *fp)
+{
+	struct mtd_dev_info mtd;
+	struct result res[TESTS];
+	char mtddev[PATH_MAX], *buf = NULL, *check = NULL;
+	int i, fd, ret = -1;
+
+	memset(res, 0, sizeof(res));
+
+	if (mtd_dev_node(desc, partition, mtddev, sizeof(mtddev)) < 0) {
+		fprintf(stderr, "MTD device #%d: %s\n", partition, strerror(errno));
+		return -1;
+	}
+	if (mtd_get_dev_info1(desc, partition, &mtd) < 0) {
+		fprintf(stderr, "Error getting MTD device #%d info\n", partition);
+		return -1;
+	}
+	if (opts->first >= 0 && (opts->first > opts->last
+	  || opts->last >= mtd.eb_cnt)) {
+		fprintf(stderr, "%d-%d: invalid block range (mtd%d has %d blocks)\n",
+		  opts->first, opts->last, partition, mtd.eb_cnt);
+		return -1;
+	}
+	if ((fd = open(mtddev, opts->first >= 0 ? O_RDWR : O_RDONLY)) < 0) {
+		fprintf(stderr, "Error opening %s: %s\n", mtddev, strerror(errno));
+		return -1;
+	}
+
+	if (!(buf = malloc(mtd.eb_size)) || !(check = malloc(mtd.eb_size)))
+		goto error_alloc;
+	for (i = 0; i < TESTS; i++)
+		if (!(res[i].us = malloc(mtd.eb_cnt * sizeof(*res[i].us))))
+			goto error_alloc;
+
+	if (test_read(&mtd, fd, buf, &res[TEST_READ]) < 0)
+		goto out;
+	if (opts->first >= 0 && test_write(desc, &mtd, fd, opts, buf, check,
+	  res) < 0)
+		goto out;
+
+	fprintf(fp, "mtd%d (%s)\n", partition, type == 2 ? "T200" : "T100");
+	ret = report(fp, type, res);
+
+	if (opts->save) {
+		if (baseline_store(type, res) < 0)
+			fprintf(stderr, "Error writing %s: %s\n", baseline_file,
+			  strerror(errno));
+		else
+			fprintf(fp, "baseline saved to %s\n", baseline_file);
+	}
+	goto out;
+
+error_alloc:
+	fprintf(stderr, "Error allocating self-test memory\n");
+out:
+	for (i = 0; i < TESTS; i++)
+		free(res[i].us);
+	free(check);
+	free(buf);
+	close(fd);
+
+	return ret;
+}
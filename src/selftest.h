@@ -0,0 +1,37 @@
+#ifndef SELFTEST_H
+#define SELFTEST_H
+
+#include <stdio.h>
+#include "libmtd.h"
+#include "tune.h"
+
+#define BASELINE_FILE TUNE_DIR "/baseline"
+
+/* The minimal throughput relative to the baseline to pass the self-test */
+#define SELFTEST_MIN_RATIO 0.8
+
+/*
+ * Card flash self-test options. The erase/write test of the eraseblocks
+ * first..last (first = -1 disables it) rewrites the blocks with their own
+ * content, so the card FW stays intact unless the test is interrupted. With
+ * save set, the results become the known-good baseline of the card type.
+ */
+struct selftest_opts {
+	int first;
+	int last;
+	int save;
+};
+
+extern const char *baseline_file;
+
+/*
+ * Measures the read throughput of the whole MTD device partition (and the
+ * erase/write throughput of the given block range) with the per-block latency
+ * distribution and compares it with the baseline of the card type. Returns 0
+ * if the test passed, 1 if the card is slower than the baseline and -1 on
+ * error.
+ */
+extern int selftest(libmtd_t desc, int partition, int type,
+  const struct selftest_opts *opts, FILE *fp);
+
+#endif /* SELFTEST_H */
@@ -0,0 +1,461 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "card.h"
+#include "flash.h"
+#include "monitor.h"
+#include "server.h"
+
+
+#define SERVER_CONN_MAX 64
+
+struct conn {
+	int fd;
+	int busy;
+};
+
+/*
+ * The card registry is shared by all the connection threads (readers) and the
+ * main thread applying the MTD hotplug events (writer). A card being flashed
+ * is marked busy in its connection slot so that no other connection can flash
+ * it at the same time.
+ */
+static struct server {
+	libmtd_t desc;
+	gid_t gid;
+	struct registry reg;
+	pthread_rwlock_t lock;
+	pthread_mutex_t conn_lock;
+	struct conn conns[SERVER_CONN_MAX];
+} srv = {
+	.lock = PTHREAD_RWLOCK_INITIALIZER,
+	.conn_lock = PTHREAD_MUTEX_INITIALIZER
+};
+
+static struct conn *conn_alloc(int fd)
+{
+	struct conn *c = NULL;
+	int i;
+
+	pthread_mutex_lock(&srv.conn_lock);
+	for (i = 0; i < SERVER_CONN_MAX; i++) {
+		if (srv.conns[i].fd < 0) {
+			c = &srv.conns[i];
+			c->fd = fd;
+			c->busy = -1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&srv.conn_lock);
+
+	return c;
+}
+
+static void conn_free(struct conn *c)
+{
+	pthread_mutex_lock(&srv.conn_lock);
+	c->fd = -1;
+	c->busy = -1;
+	pthread_mutex_unlock(&srv.conn_lock);
+}
+
+static int conn_claim(struct conn *c, int partition)
+{
+	int i, ret = 0;
+
+	pthread_mutex_lock(&srv.conn_lock);
+	for (i = 0; i < SERVER_CONN_MAX; i++)
+		if (srv.conns[i].fd >= 0 && srv.conns[i].busy == partition)
+			ret = -1;
+	if (!ret)
+		c->busy = partition;
+	pthread_mutex_unlock(&srv.conn_lock);
+
+	return ret;
+}
+
+static void conn_release(struct conn *c)
+{
+	pthread_mutex_lock(&srv.conn_lock);
+	c->busy = -1;
+	pthread_mutex_unlock(&srv.conn_lock);
+}
+
+static void do_list(FILE *out)
+{
+	pthread_rwlock_rdlock(&srv.lock);
+	list_print(out, &srv.reg);
+	pthread_rwlock_unlock(&srv.lock);
+
+	fprintf(out, "ok\n");
+}
+
+static void do_info(FILE *out, const char *path)
+{
+	uint32_t version;
+	size_t size;
+	char *data;
+
+	if (read_fw(path, &data, &size, &version) < 0) {
+		fprintf(out, "error %s: invalid FW file\n", path);
+		return;
+	}
+	free(data);
+
+	fw_info(out, version, size);
+	fprintf(out, "ok\n");
+}
+
+static void do_flash(struct conn *c, FILE *out, char *args)
+{
+	char *path = strchr(args, ' ');
+	uint32_t sn = 0, version;
+	struct flash_opts opts = {.progress_fd = fileno(out)};
+	struct card *card;
+	size_t size;
+	char *data;
+	int partition = -1, ret;
+
+	if (!path) {
+		fprintf(out, "error missing FW file\n");
+		return;
+	}
+	*path++ = '\0';
+	if (strcmp(args, "-") && str2sn(args, &sn) < 0) {
+		fprintf(out, "error %s: invalid serial number\n", args);
+		return;
+	}
+	/* FILE is an absolute path, so the option can not be confused with it */
+	if (!strncmp(path, "rollback ", 9)) {
+		opts.rollback = 1;
+		path += 9;
+	}
+
+	if (read_fw(path, &data, &size, &version) < 0) {
+		fprintf(out, "error %s: invalid FW file\n", path);
+		return;
+	}
+
+	pthread_rwlock_rdlock(&srv.lock);
+	if ((card = part_find(&srv.reg, sn, (version >> 16) & 0xff))) {
+		partition = card->fw_num;
+		sn = card->sn;
+	}
+	pthread_rwlock_unlock(&srv.lock);
+
+	if (partition < 0) {
+		fprintf(out, "error no matching card\n");
+		goto out;
+	}
+	if (conn_claim(c, partition) < 0) {
+		fprintf(out, "error card busy\n");
+		goto out;
+	}
+
+	/* The progress records are sent to the client as part of the reply */
+	fflush(out);
+	ret = flash_fw(srv.desc, partition, sn, data, size, &opts);
+	conn_release(c);
+
+	if (ret < 0)
+		fprintf(out, "error flashing failed\n");
+	else
+		fprintf(out, "ok\n");
+
+out:
+	free(data);
+}
+
+static void *conn_thread(void *arg)
+{
+	struct conn *c = arg;
+	FILE *in, *out;
+	char *line = NULL, *args;
+	size_t n = 0;
+	ssize_t len;
+	int fd;
+
+	if ((fd = dup(c->fd)) < 0)
+		goto error;
+	if (!(out = fdopen(fd, "w"))) {
+		close(fd);
+		goto error;
+	}
+	if (!(in = fdopen(c->fd, "r"))) {
+		fclose(out);
+		goto error;
+	}
+
+	while ((len = getline(&line, &n, in)) > 0) {
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if ((args = strchr(line, ' ')))
+			*args++ = '\0';
+
+		if (!strcmp(line, "list"))
+			do_list(out);
+		else if (!strcmp(line, "info") && args)
+			do_info(out, args);
+		else if (!strcmp(line, "flash") && args)
+			do_flash(c, out, args);
+		else
+			fprintf(out, "error invalid request\n");
+		if (fflush(out))
+			break;
+	}
+
+	free(line);
+	fclose(in);
+	fclose(out);
+	conn_free(c);
+
+	return NULL;
+
+error:
+	close(c->fd);
+	conn_free(c);
+
+	return NULL;
+}
+
+/*
+ * Only root, the server user and (with a server group) the members of the
+ * group may flash the cards
+ */
+static int peer_allowed(int fd)
+{
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0)
+		return 0;
+
+	return !cred.uid || cred.uid == geteuid()
+	  || (srv.gid != (gid_t)-1 && cred.gid == srv.gid);
+}
+
+static int server_accept(int sfd)
+{
+	pthread_attr_t attr;
+	pthread_t thread;
+	struct conn *c;
+	int fd;
+
+	if ((fd = accept4(sfd, NULL, NULL, SOCK_CLOEXEC)) < 0)
+		return (errno == EINTR || errno == ECONNABORTED) ? 0 : -1;
+
+	if (!peer_allowed(fd)) {
+		dprintf(fd, "error permission denied\n");
+		close(fd);
+		return 0;
+	}
+
+	if (!(c = conn_alloc(fd))) {
+		dprintf(fd, "error too many connections\n");
+		close(fd);
+		return 0;
+	}
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&thread, &attr, conn_thread, c)) {
+		dprintf(fd, "error out of resources\n");
+		close(fd);
+		conn_free(c);
+	}
+	pthread_attr_destroy(&attr);
+
+	return 0;
+}
+
+static int unix_listen(const char *path, gid_t gid)
+{
+	struct sockaddr_un addr;
+	mode_t mode = gid != (gid_t)-1 ? 0660 : 0600, mask;
+	struct stat st;
+	int fd, ret;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return -1;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		fprintf(stderr, "Error opening server socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	/* A stale socket of a previous server is replaced, nothing else */
+	if (lstat(path, &st) == 0) {
+		if (!S_ISSOCK(st.st_mode)) {
+			fprintf(stderr, "%s: not a socket, refusing to replace it\n",
+			  path);
+			goto error;
+		}
+		unlink(path);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	/* No connection before the permissions are set */
+	mask = umask(0777 & ~mode);
+	ret = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+	umask(mask);
+	if (ret < 0 || chmod(path, mode) < 0
+	  || (gid != (gid_t)-1 && chown(path, -1, gid) < 0)
+	  || listen(fd, SOMAXCONN) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		goto error;
+	}
+
+	return fd;
+
+error:
+	close(fd);
+	return -1;
+}
+
+static int unix_connect(const char *path)
+{
+	struct sockaddr_un addr;
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: socket path too long\n", path);
+		return -1;
+	}
+	if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+		fprintf(stderr, "Error opening client socket: %s\n", strerror(errno));
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+int server(libmtd_t desc, const char *path, const char *uevent_path, gid_t gid)
+{
+	struct pollfd pfd[2];
+	int sfd, ufd, i, ret;
+
+	srv.desc = desc;
+	srv.gid = gid;
+	for (i = 0; i < SERVER_CONN_MAX; i++) {
+		srv.conns[i].fd = -1;
+		srv.conns[i].busy = -1;
+	}
+
+	/* Disconnected clients must not kill the server (or a running flash) */
+	signal(SIGPIPE, SIG_IGN);
+
+	if ((ufd = uevent_open(uevent_path)) < 0)
+		return -1;
+	if ((sfd = unix_listen(path, gid)) < 0)
+		goto error_uevent;
+	if (uevent_rescan(desc, &srv.reg) < 0)
+		goto error_sock;
+
+	pfd[0].fd = sfd;
+	pfd[0].events = POLLIN;
+	pfd[1].fd = ufd;
+	pfd[1].events = POLLIN;
+
+	while (1) {
+		if (poll(pfd, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "poll: %s\n", strerror(errno));
+			goto error_sock;
+		}
+
+		if (pfd[1].revents) {
+			pthread_rwlock_wrlock(&srv.lock);
+			ret = uevent_handle(ufd, desc, &srv.reg);
+			pthread_rwlock_unlock(&srv.lock);
+			if (ret < 0)
+				goto error_sock;
+		}
+		if (pfd[0].revents && server_accept(sfd) < 0) {
+			fprintf(stderr, "accept: %s\n", strerror(errno));
+			goto error_sock;
+		}
+	}
+
+error_sock:
+	close(sfd);
+	unlink(path);
+error_uevent:
+	uevent_close(ufd, uevent_path);
+
+	return -1;
+}
+
+int client(const char *path, const char *request, int progress_fd)
+{
+	FILE *in;
+	char *line = NULL;
+	size_t n = 0;
+	ssize_t len;
+	int fd, err = 0, ret = -1;
+
+	if ((fd = unix_connect(path)) < 0)
+		return -1;
+	/*
+	 * A refused connection is closed by the server right after the error
+	 * reply, so the reply is read even if the request can not be sent
+	 */
+	if (send(fd, request, strlen(request), MSG_NOSIGNAL) < 0
+	  || send(fd, "\n", 1, MSG_NOSIGNAL) < 0)
+		err = errno;
+	if (!(in = fdopen(fd, "r"))) {
+		close(fd);
+		return -1;
+	}
+
+	while ((len = getline(&line, &n, in)) > 0) {
+		if (line[0] == '{') {
+			if (progress_fd >= 0 && write(progress_fd, line, len) < 0)
+				progress_fd = -1;
+			continue;
+		}
+		if (line[len - 1] == '\n')
+			line[len - 1] = '\0';
+		if (!strcmp(line, "ok")) {
+			ret = 0;
+			break;
+		}
+		if (!strncmp(line, "error ", 6)) {
+			fprintf(stderr, "%s\n", line + 6);
+			break;
+		}
+		printf("%s\n", line);
+	}
+	if (len <= 0)
+		fprintf(stderr, "%s: %s\n", path,
+		  err ? strerror(err) : "connection closed by server");
+
+	free(line);
+	fclose(in);
+
+	return ret;
+}
@@ -0,0 +1,36 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <sys/types.h>
+#include "libmtd.h"
+
+/*
+ * Server mode keeping the libmtd descriptor and the card inventory (updated
+ * from the MTD hotplug uevents) resident. Requests are accepted on the Unix
+ * stream socket path, each connection is served by its own thread. The
+ * protocol is line based, a request is one of:
+ *
+ *   list
+ *   info FILE
+ *   flash SN|- [rollback] FILE
+ *
+ * and the reply is the same output fw-flash prints for the request (plus the
+ * progress JSON records of a flash) terminated by an "ok" or "error MESSAGE"
+ * line. FILE paths are resolved by the server and must be absolute. rollback
+ * flashes the card as fw-flash --rollback does.
+ *
+ * The socket is only accessible by the server user (mode 0600), or also by
+ * the group gid (mode 0660) unless gid is -1. Connections of other users than
+ * root, the server user and the group gid members (primary group) are
+ * refused. An existing file at path is only replaced if it is a socket.
+ */
+extern int server(libmtd_t desc, const char *path, const char *uevent_path,
+  gid_t gid);
+
+/*
+ * Sends the request to the server on path and prints the reply. Progress
+ * records are forwarded to progress_fd unless it is -1.
+ */
+extern int client(const char *path, const char *request, int progress_fd);
+
+#endif /* SERVER_H */
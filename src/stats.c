@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <time.h>
+#include <inttypes.h>
+#include "card.h"
+#include "stats.h"
+
+
+struct phase {
+	uint64_t ns;
+	uint64_t bytes;
+	int cnt;
+};
+
+static const char *phase_names[STATS_PHASES] = {
+	"open", "list", "read", "crc", "erase", "write"
+};
+
+enum stats_format stats_format = STATS_NONE;
+
+static struct phase phases[STATS_PHASES];
+static uint64_t start_ns;
+static uint32_t card_sn;
+static int card_num = -1;
+
+uint64_t stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void stats_add(enum stats_phase phase, uint64_t start, uint64_t bytes)
+{
+	if (stats_format == STATS_NONE)
+		return;
+
+	if (!start_ns)
+		start_ns = start;
+	phases[phase].ns += stats_now() - start;
+	phases[phase].bytes += bytes;
+	phases[phase].cnt++;
+}
+
+void stats_card(uint32_t sn, int num)
+{
+	card_sn = sn;
+	card_num = num;
+}
+
+static int cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+void stats_sort(uint32_t *v, int cnt)
+{
+	qsort(v, cnt, sizeof(*v), cmp_u32);
+}
+
+uint32_t stats_pct(const uint32_t *v, int cnt, int p)
+{
+	int i = (cnt * p + 99) / 100;
+
+	return cnt ? v[i > 0 ? i - 1 : 0] : 0;
+}
+
+double stats_mbps(uint64_t bytes, uint64_t ns)
+{
+	return ns ? (double)bytes * 1000.0 / ns : 0;
+}
+
+static void print_text(FILE *fp, uint64_t total)
+{
+	char sn[16];
+	int i;
+
+	if (card_num >= 0) {
+		sn2str(card_sn, sn, sizeof(sn));
+		fprintf(fp, "card: %s (mtd%d)\n", sn, card_num);
+	}
+	fprintf(fp, "%-6s %12s %12s %10s\n", "phase", "time [ms]", "bytes", "MB/s");
+	for (i = 0; i < STATS_PHASES; i++) {
+		if (!phases[i].cnt)
+			continue;
+		fprintf(fp, "%-6s %12.3f", phase_names[i], phases[i].ns / 1e6);
+		if (phases[i].bytes)
+			fprintf(fp, " %12" PRIu64 " %10.2f\n", phases[i].bytes,
+			  stats_mbps(phases[i].bytes, phases[i].ns));
+		else
+			fprintf(fp, " %12s %10s\n", "-", "-");
+	}
+	fprintf(fp, "%-6s %12.3f\n", "total", total / 1e6);
+}
+
+static void print_json(FILE *fp, uint64_t total)
+{
+	char sn[16];
+	int i, first = 1;
+
+	fprintf(fp, "{");
+	if (card_num >= 0) {
+		sn2str(card_sn, sn, sizeof(sn));
+		fprintf(fp, "\"card\":\"%s\",\"mtd\":%d,", sn, card_num);
+	}
+	fprintf(fp, "\"phases\":{");
+	for (i = 0; i < STATS_PHASES; i++) {
+		if (!phases[i].cnt)
+			continue;
+		fprintf(fp, "%s\"%s\":{\"ns\":%" PRIu64 ",\"bytes\":%" PRIu64
+		  ",\"mbps\":%.3f}", first ? "" : ",", phase_names[i], phases[i].ns,
+		  phases[i].bytes, stats_mbps(phases[i].bytes, phases[i].ns));
+		first = 0;
+	}
+	fprintf(fp, "},\"total_ns\":%" PRIu64 "}\n", total);
+}
+
+void stats_print(FILE *fp)
+{
+	uint64_t total = start_ns ? stats_now() - start_ns : 0;
+
+	if (stats_format == STATS_TEXT)
+		print_text(fp, total);
+	else if (stats_format == STATS_JSON)
+		print_json(fp, total);
+}
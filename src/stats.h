@@ -0,0 +1,36 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+
+enum stats_phase {
+	STATS_OPEN,
+	STATS_LIST,
+	STATS_READ,
+	STATS_CRC,
+	STATS_ERASE,
+	STATS_WRITE,
+	STATS_PHASES
+};
+
+enum stats_format {
+	STATS_NONE,
+	STATS_TEXT,
+	STATS_JSON
+};
+
+extern enum stats_format stats_format;
+
+extern uint64_t stats_now(void);
+extern void stats_add(enum stats_phase phase, uint64_t start, uint64_t bytes);
+extern void stats_card(uint32_t sn, int num);
+extern void stats_print(FILE *fp);
+/* The throughput of bytes transferred in ns nanoseconds in MB/s */
+extern double stats_mbps(uint64_t bytes, uint64_t ns);
+
+/* stats_pct() returns the p-th percentile of values sorted by stats_sort() */
+extern void stats_sort(uint32_t *v, int cnt);
+extern uint32_t stats_pct(const uint32_t *v, int cnt, int p);
+
+#endif /* STATS_H */
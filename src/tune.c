@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "tune.h"
+
+
+const char *tune_file = TUNE_FILE;
+
+int tune_load(const char *file, int type, int eb_size, struct tune *tune)
+{
+	char line[128];
+	int t, eb, wc, rc, ret = -1;
+	FILE *fp;
+
+	if (!(fp = fopen(file, "r")))
+		return -1;
+
+	while (fgets(line, sizeof(line), fp)) {
+		if (sscanf(line, "%d %d %d %d", &t, &eb, &wc, &rc) != 4)
+			continue;
+		if (t == type && eb == eb_size && wc > 0 && rc > 0) {
+			tune->write_chunk = wc;
+			tune->read_chunk = rc;
+			ret = 0;
+		}
+	}
+	fclose(fp);
+
+	return ret;
+}
+
+int mkparent(const char *path)
+{
+	char dir[PATH_MAX], *p;
+
+	if (snprintf(dir, sizeof(dir), "%s", path) >= sizeof(dir)) {
+		errno = ENAMETOOLONG;
+		return -1;
+	}
+	for (p = dir + 1; (p = strchr(p, '/')); p++) {
+		*p = '\0';
+		if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+			return -1;
+		*p = '/';
+	}
+
+	return 0;
+}
+
+int tune_store(const char *file, int type, int eb_size,
+  const struct tune *tune)
+{
+	char tmp[PATH_MAX], line[128];
+	int t, eb, wc, rc, fd;
+	FILE *in, *out;
+
+	if (snprintf(tmp, sizeof(tmp), "%s.XXXXXX", file) >= sizeof(tmp))
+		return -1;
+	if (mkparent(file) < 0)
+		return -1;
+	if ((fd = mkstemp(tmp)) < 0)
+		return -1;
+	if (fchmod(fd, 0644) < 0 || !(out = fdopen(fd, "w"))) {
+		close(fd);
+		goto error;
+	}
+
+	/* Keep the results of the other card types/eraseblock sizes */
+	if ((in = fopen(file, "r"))) {
+		while (fgets(line, sizeof(line), in)) {
+			if (sscanf(line, "%d %d %d %d", &t, &eb, &wc, &rc) != 4
+			  || (t == type && eb == eb_size))
+				continue;
+			fputs(line, out);
+		}
+		fclose(in);
+	}
+	fprintf(out, "%d %d %d %d\n", type, eb_size, tune->write_chunk,
+	  tune->read_chunk);
+
+	if (fclose(out))
+		goto error;
+	if (rename(tmp, file) < 0)
+		goto error;
+
+	return 0;
+
+error:
+	unlink(tmp);
+
+	return -1;
+}
@@ -0,0 +1,31 @@
+#ifndef TUNE_H
+#define TUNE_H
+
+#define TUNE_DIR  "/var/lib/fw-flash"
+#define TUNE_FILE TUNE_DIR "/tune"
+
+/* The largest calibrated chunk size in eraseblocks */
+#define TUNE_EB_MAX 4
+
+/*
+ * Best write/read chunk sizes (as measured by flashing with --calibrate) of
+ * a card type and eraseblock size. The results are kept in a file (tune_file
+ * by default), one "TYPE EB_SIZE WRITE_CHUNK READ_CHUNK" line per card type and
+ * eraseblock size.
+ */
+struct tune {
+	int write_chunk;
+	int read_chunk;
+};
+
+extern const char *tune_file;
+
+/* Creates the missing parent directories of the state file path */
+extern int mkparent(const char *path);
+
+extern int tune_load(const char *file, int type, int eb_size,
+  struct tune *tune);
+extern int tune_store(const char *file, int type, int eb_size,
+  const struct tune *tune);
+
+#endif /* TUNE_H */